@@ -0,0 +1,82 @@
+/*
+ * ===============================================================================
+ * SPAWN BENCHMARK
+ * ===============================================================================
+ * Measures per-command spawn latency of the two spawn_program() backends (see
+ * "PROCESS SPAWNING" in src/main.c): start a program, wait for it, repeat.
+ * - fork:        fork() + execv(), the shell's only way before posix_spawn;
+ * - posix_spawn: the default (clone(CLONE_VM | CLONE_VFORK) inside glibc).
+ * Each runs with the shell's own small footprint, then again with a large
+ * touched heap, where fork() has to copy the page tables and posix_spawn()
+ * does not. Every command also gets a "> /dev/null" redirection, so the fd
+ * actions are part of the measurement.
+ *
+ * Build and run (not part of the default build):
+ *   cmake -S . -B build && cmake --build build --target spawn_bench
+ *   ./build/spawn_bench [commands] [heap MiB] [program]
+ * ===============================================================================
+ */
+
+#define main shell_main // The shell's own entry point is not used here
+#include "../src/main.c"
+#undef main
+
+double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Starts and reaps 'program' 'count' times. Returns microseconds per command.
+double bench_spawn(enum spawn_backend backend, const char *program, int count) {
+  spawn_backend = backend;
+  char *argv[] = {(char *)program, NULL};
+  struct fd_action actions[] = {
+    {FD_ACTION_OPEN, STDOUT_FILENO, -1, "/dev/null", O_WRONLY | O_CREAT | O_TRUNC},
+  };
+
+  double start = bench_now();
+  for (int i = 0; i < count; i++) {
+    pid_t pid = spawn_program(program, argv, actions, 1, NULL);
+    if (pid < 0) exit(1); // Already reported
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  }
+  return (bench_now() - start) / count * 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  int count = argc > 1 ? atoi(argv[1]) : 2000;
+  long heap_mib = argc > 2 ? atol(argv[2]) : 512;
+  const char *program = argc > 3 ? argv[3] : "/bin/true";
+  if (count <= 0 || heap_mib < 0) {
+    fprintf(stderr, "usage: %s [commands] [heap MiB] [program]\n", argv[0]);
+    return 2;
+  }
+
+  printf("%d x %s, microseconds per command\n\n", count, program);
+  printf("%-24s %12s %12s\n", "footprint", "fork", "posix_spawn");
+
+  for (int round = 0; round < 2; round++) {
+    char label[64];
+    char *heap = NULL;
+    if (round == 0) {
+      snprintf(label, sizeof(label), "shell as-is");
+    } else {
+      if (heap_mib == 0) break;
+      // Touched, so every page is mapped and fork() has to copy its entry
+      heap = malloc(heap_mib << 20);
+      if (!heap) {
+        perror("malloc");
+        return 1;
+      }
+      memset(heap, 1, heap_mib << 20);
+      snprintf(label, sizeof(label), "with %ld MiB of heap", heap_mib);
+    }
+    double fork_us = bench_spawn(SPAWN_FORK, program, count);
+    double spawn_us = bench_spawn(SPAWN_POSIX_SPAWN, program, count);
+    printf("%-24s %12.1f %12.1f\n", label, fork_us, spawn_us);
+    free(heap);
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * ===============================================================================
+ * TOKENIZER BENCHMARK
+ * ===============================================================================
+ * Measures the tokenizer's delimiter scanners (see "Delimiter scanning" in
+ * src/main.c) in bytes/second, on a generated rm/xargs-style line with
+ * thousands of paths:
+ * - scan:     walking the line with one scan_ordinary_*() function alone;
+ * - tokenize: the whole tokenize_line() with that scanner plugged in.
+ * "per-byte" is the baseline: a scanner that never skips anything, so the
+ * tokenizer loop handles every byte itself, exactly as it did before the
+ * delimiter scanners existed. "scalar" is the portable scanner the vector ones
+ * fall back to.
+ *
+ * Build and run (not part of the default build):
+ *   cmake -S . -B build && cmake --build build --target tokenizer_bench
+ *   ./build/tokenizer_bench [paths]
+ * ===============================================================================
+ */
+
+#define main shell_main // The shell's own entry point is not used here
+#include "../src/main.c"
+#undef main
+
+#define BENCH_MIN_SECONDS 0.25 // Each measurement repeats until it has run this long
+
+struct bench_scanner {
+  const char *name;
+  size_t (*scan)(const char *p);
+  int usable;
+};
+
+// Stops at every byte: tokenize_line() with this is the tokenizer before scan_ordinary
+size_t scan_ordinary_none(const char *p) {
+  (void)p;
+  return 0;
+}
+
+double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * "rm -f" followed by 'count' paths, like the lines xargs builds. One path in
+ * 32 is quoted, so the quote handling is part of the measurement too.
+ */
+char *bench_make_line(int count, size_t *length) {
+  struct line_buffer line = {0};
+  line_buffer_reserve(&line, 0);
+  line.data[0] = '\0';
+  line_buffer_append_str(&line, "rm -f");
+  char path[128];
+  for (int i = 0; i < count; i++) {
+    if (i % 32 == 31) {
+      snprintf(path, sizeof(path), " '/var/tmp/build output/module_%05d/object file_%05d.o'", i / 100, i);
+    } else {
+      snprintf(path, sizeof(path), " /var/tmp/build/obj/module_%05d/src/generated_file_%05d.o", i / 100, i);
+    }
+    line_buffer_append_str(&line, path);
+  }
+  *length = line.len;
+  return line.data;
+}
+
+// Walks the whole line stopping at every special byte, as the tokenizer does
+size_t bench_scan_line(size_t (*scan)(const char *p), const char *line) {
+  size_t stops = 0;
+  for (const char *p = line; *p != '\0'; p++) {
+    p += scan(p);
+    if (*p == '\0') break;
+    stops++;
+  }
+  return stops;
+}
+
+// Runs 'scan' over the line until BENCH_MIN_SECONDS have passed. Returns bytes/second.
+double bench_scan(size_t (*scan)(const char *p), const char *line, size_t length) {
+  volatile size_t sink = 0;
+  long rounds = 0;
+  double start = bench_now();
+  double elapsed;
+  do {
+    sink += bench_scan_line(scan, line);
+    rounds++;
+    elapsed = bench_now() - start;
+  } while (elapsed < BENCH_MIN_SECONDS);
+  (void)sink;
+  return (double)length * rounds / elapsed;
+}
+
+/*
+ * Tokenizes a fresh copy of the line (tokenize_line() works in place) until
+ * BENCH_MIN_SECONDS have passed. Returns bytes/second, copy included.
+ */
+double bench_tokenize(size_t (*scan)(const char *p), const char *line, size_t length, int *token_count) {
+  char *copy = malloc(length + 1);
+  if (!copy) {
+    perror("malloc");
+    exit(1);
+  }
+  struct token_list tokens = {0};
+  scan_ordinary = scan;
+  long rounds = 0;
+  double start = bench_now();
+  double elapsed;
+  do {
+    memcpy(copy, line, length + 1);
+    *token_count = tokenize_line(copy, &tokens);
+    rounds++;
+    elapsed = bench_now() - start;
+  } while (elapsed < BENCH_MIN_SECONDS);
+  free(tokens.items);
+  free(copy);
+  return (double)length * rounds / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int paths = argc > 1 ? atoi(argv[1]) : 5000;
+  if (paths <= 0) {
+    fprintf(stderr, "usage: %s [paths]\n", argv[0]);
+    return 2;
+  }
+
+  struct bench_scanner scanners[] = {
+    {"per-byte", scan_ordinary_none, 1},
+    {"scalar", scan_ordinary_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse2", scan_ordinary_sse2, 0},
+    {"avx2", scan_ordinary_avx2, 0},
+#endif
+  };
+  int scanner_count = sizeof(scanners) / sizeof(scanners[0]);
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  scanners[2].usable = __builtin_cpu_supports("sse2");
+  scanners[3].usable = __builtin_cpu_supports("avx2");
+#endif
+
+  size_t length;
+  char *line = bench_make_line(paths, &length);
+  printf("line: %d paths, %zu bytes\n\n", paths, length);
+  printf("%-10s %14s %14s %12s\n", "scanner", "scan MB/s", "tokenize MB/s", "vs per-byte");
+
+  double baseline = 0;
+  int expected_tokens = -1;
+  for (int i = 0; i < scanner_count; i++) {
+    if (!scanners[i].usable) {
+      printf("%-10s %14s\n", scanners[i].name, "(no CPU support)");
+      continue;
+    }
+    double scan_rate = bench_scan(scanners[i].scan, line, length);
+    int token_count;
+    double tokenize_rate = bench_tokenize(scanners[i].scan, line, length, &token_count);
+    if (expected_tokens < 0) expected_tokens = token_count;
+    if (token_count != expected_tokens) {
+      fprintf(stderr, "%s: %d tokens instead of %d\n", scanners[i].name, token_count, expected_tokens);
+      return 1;
+    }
+    if (baseline == 0) baseline = tokenize_rate;
+    printf("%-10s %14.1f %14.1f %11.2fx\n", scanners[i].name, scan_rate / 1e6, tokenize_rate / 1e6, tokenize_rate / baseline);
+  }
+  free(line);
+  return 0;
+}
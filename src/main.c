@@ -7,47 +7,163 @@
  * 1. REPL (Read-Eval-Print Loop): Continuously accepts user input.
  * 2. Raw Mode Input: Disables standard terminal line buffering to handle 
  * TAB completion and Backspace manually.
+ *    Scripts ("shell file.sh", "shell -c '...'", piped stdin) skip the editor
+ *    and prompts entirely and run line after line.
  * 3. Tokenizer: Custom parsing logic to handle spaces, quotes (' and "), and escapes (\).
- * 4. Built-ins: cd, echo, exit, type, pwd, help.
- * 5. External Commands: Uses fork() and exec() to run system programs (e.g., ls, grep).
- * 6. Redirection: Supports >, >>, 2>, 2>> by manipulating File Descriptors.
+ * 4. Built-ins: cd, echo, exit, type, pwd, help, hash.
+ *    Command lists: ';', '&&', '||', '( ... )' subshells and '{ ...; }' groups,
+ *    parsed into a syntax tree and evaluated with real exit statuses.
+ *    Job control: 'cmd &', jobs, fg, bg, wait; Ctrl+Z stops the foreground job.
+ *    parallel: runs a command once per argument, N at a time, output kept in order.
+ *    'time pipeline' and 'times' report CPU time and memory collected with wait4().
+ *    Exit statuses: $?, ${PIPESTATUS[@]}, 'set -e' and 'set -o pipefail'.
+ *    cat and tee move data inside the kernel (splice, tee, copy_file_range, sendfile).
+ * 5. External Commands: Uses posix_spawn() (or fork() + exec()) to run system programs (e.g., ls, grep).
+ *    PATH directories are indexed in memory and kept current with inotify, and
+ *    resolved paths are remembered in a hash table so repeated commands skip the lookup.
+ * 6. Redirection: Ordered lists of <, >, >>, &>, N>&M and N>&- on any fd number, plus
+ *    heredocs (<<, <<-) and here-strings (<<<) fed from memory, never a temp file.
  * * ======================================================================================
  */
 
+#define _GNU_SOURCE // pipe2(), inotify, Linux-specific extensions
+
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2/AVX2 intrinsics for the tokenizer's delimiter scan
+#endif
 #include <sys/wait.h>
 #include <termios.h>  // Required for raw mode (terminal settings)
 #include <dirent.h>
 
 #define MAX_PATH_ENTRIES 100
-#define MAX_ARGS 100
+#define CMD_HASH_BUCKETS 256
+#define NEG_CACHE_SLOTS 128
+#define INPUT_RING_SIZE 65536 // Must be a power of two (indices are masked)
+#define ARENA_MIN_BLOCK 16384
+#define LINE_BUFFER_MIN 1024
+#define BUILTIN_OUT_SIZE 65536 // One pipe buffer's worth
+#define COPY_CHUNK 131072      // Bytes per splice()/read() round in cat and tee
+#define SCRIPT_PEEK_SIZE 1024  // Bytes of piped script looked at per line (see read_script_line)
+#define SHELL_FD_MIN 10        // The shell's own fds live from here up; 3-9 are the user's
+#define EXPAND_MARK '\x1d' // Stands for a '$' that starts an expansion (see EXIT STATUS & PARAMETER EXPANSION)
 
 // ================================================================================
 // FORWARD DECLARATIONS
 // ================================================================================
 // C requires functions to be declared before they are used if they are defined later.
-int shell_cd(int argc, char *argv[]);
-int shell_pwd(int argc, char *argv[]);
-int shell_exit(int argc, char *argv[]);
-int shell_echo(int argc, char *argv[]);
-int shell_help(int argc, char *argv[]);
-int shell_type(int argc, char *argv[]);
+struct builtin_io;
+int shell_cd(int argc, char *argv[], struct builtin_io *io);
+int shell_pwd(int argc, char *argv[], struct builtin_io *io);
+int shell_exit(int argc, char *argv[], struct builtin_io *io);
+int shell_echo(int argc, char *argv[], struct builtin_io *io);
+int shell_help(int argc, char *argv[], struct builtin_io *io);
+int shell_type(int argc, char *argv[], struct builtin_io *io);
+int shell_hash(int argc, char *argv[], struct builtin_io *io);
+int shell_memstats(int argc, char *argv[], struct builtin_io *io);
+int shell_jobs(int argc, char *argv[], struct builtin_io *io);
+int shell_fg(int argc, char *argv[], struct builtin_io *io);
+int shell_bg(int argc, char *argv[], struct builtin_io *io);
+int shell_wait(int argc, char *argv[], struct builtin_io *io);
+int shell_parallel(int argc, char *argv[], struct builtin_io *io);
+int shell_times(int argc, char *argv[], struct builtin_io *io);
+int shell_set(int argc, char *argv[], struct builtin_io *io);
+int shell_cat(int argc, char *argv[], struct builtin_io *io);
+int shell_tee(int argc, char *argv[], struct builtin_io *io);
 int num_builtins();
-int parse_command(const char *line, char *argv[], int max_args);
-int setup_redirect_fd(const char *path, int target_fd, int should_exit_on_error, int append_mode);
-int save_and_redirect_fd(const char *path, int target_fd, int append_mode);
-int read_input_line(char *buffer, size_t size);
+struct token_list;
+int tokenize_line(char *line, struct token_list *tokens);
+struct node;
+int execute_node(struct node *node);
+void select_token_scanner();
+struct line_buffer;
+void line_buffer_reserve(struct line_buffer *line, size_t extra);
+int read_input_line(struct line_buffer *line);
 char* ext_check(char *program_name);
+char* path_search(const char *program_name);
+struct cmd_hash_entry* cmd_hash_find(const char *name);
+struct cmd_hash_entry* cmd_hash_add(const char *name, const char *path);
+int cmd_hash_delete(const char *name);
+void cmd_hash_reset();
+int neg_cache_lookup(const char *name);
+void neg_cache_insert(const char *name);
+void neg_cache_reset();
+int path_dirs_changed();
 const char* complete_builtin(const char *prefix);
 char* complete_executable(const char *prefix);
 void parse_path(char *path_string);
-void execute_external_program(char *full_path, int argc, char *argv[], char *redirect_out, char *redirect_err, int redirect_out_append, int redirect_err_append);
-void restore_fd(int saved_fd, int target_fd);
+void path_index_init();
+void path_index_drain();
+int path_index_contains(int dir_idx, const char *name);
+int compare_strings(const void *a, const void *b);
+int sorted_lower_bound(char **names, int count, const char *key);
+struct arena;
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_reset(struct arena *arena);
+struct fd_action;
+int redirect_flags(int append_mode);
+int heredoc_fd(const char *data);
+void heredoc_push(struct fd_action *action, const char *delimiter, int strip_tabs, int expand);
+void select_spawn_backend(const char *name);
+struct job;
+pid_t spawn_program(const char *full_path, char *argv[], struct fd_action *actions, int action_count, struct job *job);
+struct command;
+int execute_external_program(char *full_path, struct command *cmd);
+int decode_wait_status(int status);
+void line_buffer_append_str(struct line_buffer *line, const char *str);
+void job_signal_set(sigset_t *set);
+void job_enter_group_in_child(struct job *job);
+void job_init(struct job *job, struct node **stages, int stage_count, int foreground);
+void job_add_process(struct job *job, int index, pid_t pid);
+struct job *job_add(struct job *job);
+void job_remove(struct job *job);
+void job_reap();
+void job_poll(struct job *job);
+struct job *job_by_pid(pid_t pid, int *index);
+void job_record_status(struct job *job, int index, int status, const struct rusage *usage);
+double timeval_seconds(struct timeval tv);
+void format_duration(char *buf, size_t size, double seconds);
+void job_forget_process(struct job *job, int index);
+int events_watch_child(pid_t pid);
+void events_init(int watch_stdin);
+int events_wait(int timeout_ms);
+void events_wait_for_input();
+void events_catch_interrupt(int on);
+void job_notify();
+int out_flush();
+void close_builtin_io(struct builtin_io *io);
+struct saved_fd;
+void restore_redirections(struct saved_fd *saved, int count);
+void job_print(struct job *job);
+struct job *job_current(int previous);
+struct job *job_find(const char *builtin_name, const char *spec, int err_fd);
+int job_wait_blocking(struct job *job);
+int wait_for_job(struct job *job);
+void terminal_give_to_job(struct job *job);
 
 // ================================================================================
 // TERMINAL MODE HANDLING (Raw vs Canonical)
@@ -57,8 +173,11 @@ void restore_fd(int saved_fd, int target_fd);
 // To support TAB completion, we need "Raw Mode", where we receive every keypress immediately.
 
 struct termios original_termios; // Store original settings to restore them on exit
+struct termios raw_termios;      // Line editor settings, re-applied after each foreground job
+pid_t shell_pid; // Forked helper children (builtins in pipelines) must not touch the terminal
 
 void disable_raw_mode() {
+  if (getpid() != shell_pid) return;
   // Restore the terminal to its original state (Canonical mode) so other programs behave normally.
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
 }
@@ -66,6 +185,7 @@ void disable_raw_mode() {
 void enable_raw_mode() {
   // Get current terminal attributes
   tcgetattr(STDIN_FILENO, &original_termios);
+  shell_pid = getpid();
   
   // Register disable_raw_mode to run automatically when the program exits (even on crash/error)
   atexit(disable_raw_mode);
@@ -80,6 +200,7 @@ void enable_raw_mode() {
   
   // Apply the new settings
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+  raw_termios = raw;
 }
 
 // ================================================================================
@@ -87,8 +208,19 @@ void enable_raw_mode() {
 // ================================================================================
 // We map string command names (like "cd") to actual C functions.
 
-// function signature typedef: A function that takes argc/argv and returns an int.
-typedef int (*builtin_func)(int argc, char *argv[]);
+// The fds a builtin reads from and writes to. Its redirections are opened and
+// passed in here, instead of being dup2'ed over the shell's own 0/1/2 and
+// restored afterwards.
+struct builtin_io {
+  int in;
+  int out;
+  int err;
+  int *opened; // Descriptors open_builtin_io() opened, for close_builtin_io()
+  int opened_count;
+};
+
+// function signature typedef: A function that takes argc/argv (and its fds) and returns an int.
+typedef int (*builtin_func)(int argc, char *argv[], struct builtin_io *io);
 
 struct builtin {
   char *name;
@@ -103,41 +235,388 @@ struct builtin builtins[] = {
   {"type", shell_type},
   {"pwd", shell_pwd},
   {"cd", shell_cd},
+  {"hash", shell_hash},
+  {"memstats", shell_memstats},
+  {"jobs", shell_jobs},
+  {"fg", shell_fg},
+  {"bg", shell_bg},
+  {"wait", shell_wait},
+  {"parallel", shell_parallel},
+  {"times", shell_times},
+  {"set", shell_set},
+  {"cat", shell_cat},
+  {"tee", shell_tee},
+};
+
+// Children are started through spawn_program(), which has two backends:
+// - posix_spawn: glibc implements it with clone(CLONE_VM | CLONE_VFORK), so the
+//   child borrows our memory instead of copying page tables. This is the default.
+// - fork: classic fork() + execv(); cost grows with the shell's memory footprint.
+// Select one with the SHELL_SPAWN environment variable ("posix_spawn" or "fork").
+//
+// The fd setup the child needs (redirections, pipe ends) is described as a list
+// of fd_actions, applied in order. They map 1:1 onto posix_spawn file actions,
+// and the fork backend simply performs them in the child before execv().
+
+extern char **environ;
+
+enum spawn_backend { SPAWN_POSIX_SPAWN, SPAWN_FORK };
+enum spawn_backend spawn_backend = SPAWN_POSIX_SPAWN;
+
+// Status for the last program spawn_program() could not start: 1 (a redirection
+// failed), 127 (no such program) or 126 (anything else)
+int spawn_failure_status;
+
+enum fd_action_kind { FD_ACTION_OPEN, FD_ACTION_DUP2, FD_ACTION_CLOSE, FD_ACTION_DATA };
+
+struct fd_action {
+  enum fd_action_kind kind;
+  int fd;           // Descriptor to open onto / duplicate onto / close / feed
+  int src_fd;       // DUP2 only: descriptor to copy
+  const char *path; // OPEN: file to open. DATA: the text the fd reads (heredoc body)
+  int flags;        // OPEN: open() flags. DUP2: FD_SOURCE_SHELL or 0
+};
+
+// A DUP2 whose source is the shell's own (a pipe end) rather than one the user
+// named with "N>&M": only the latter must be an fd the user could have opened
+enum { FD_SOURCE_SHELL = 1 };
+
+// ================================================================================
+// PER-LINE ARENA
+// ================================================================================
+// Everything built while running one input line (tokens, argv arrays, redirection
+// targets, pipeline bookkeeping) is bump-allocated from 'line_arena' and released
+// all at once by arena_reset() when the line is done. Blocks are kept between
+// lines, so once the arena has grown to fit the typical line, running a command
+// makes no malloc/free calls for its parse data at all.
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size; // Usable bytes in data[]
+  size_t used;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *first;
+  struct arena_block *current; // Block allocations are served from
+  // Counters for the 'memstats' builtin
+  unsigned long allocations;  // arena_alloc() calls served
+  unsigned long malloc_calls; // Blocks obtained from malloc()
+  unsigned long resets;
+};
+
+struct arena line_arena;
+
+// One simple command: its arguments plus the redirections the parser pulled out
+// of them. The redirections are kept as the fd actions they turn into, in the
+// order they were written ("> f 2>&1" and "2>&1 > f" differ). The strings point
+// into the input line (see tokenize_line) or 'line_arena'; nothing here is freed
+// individually.
+struct command {
+  int argc;
+  char **argv;                 // NULL-terminated
+  struct fd_action *redirects; // OPEN, DUP2 ("2>&1") or CLOSE ("2>&-")
+  int redirect_count;
+};
+
+// Tokens produced by tokenize_line(). Words point into the input line.
+enum token_kind {
+  TOKEN_WORD,
+  TOKEN_PIPE,     // |
+  TOKEN_OR_IF,    // ||
+  TOKEN_AMP,      // &
+  TOKEN_AND_IF,   // &&
+  TOKEN_SEMI,     // ;
+  TOKEN_LPAREN,   // (
+  TOKEN_RPAREN,   // )
+  TOKEN_REDIRECT, // < > >> <& >& &> &>> << <<- <<<, optionally with an fd number ("2>")
+};
+
+enum redirect_op {
+  REDIRECT_OUTPUT,       // >
+  REDIRECT_APPEND,       // >>
+  REDIRECT_INPUT,        // <
+  REDIRECT_DUP_OUTPUT,   // >&
+  REDIRECT_DUP_INPUT,    // <&
+  REDIRECT_BOTH,         // &>  (stdout and stderr)
+  REDIRECT_BOTH_APPEND,  // &>>
+  REDIRECT_HEREDOC,      // <<
+  REDIRECT_HEREDOC_TABS, // <<-
+  REDIRECT_HERESTRING,   // <<<
+};
+
+struct token {
+  enum token_kind kind;
+  char *text;                // WORD only: the unquoted text
+  int quoted;                // WORD only: contained quotes/escapes (so '{' is not a keyword)
+  int io_number;             // REDIRECT only: the N of "N>", or -1 (the operator's default fd)
+  enum redirect_op redirect; // REDIRECT only
+};
+
+// Reused for every line; grows geometrically, like 'input_line'
+struct token_list {
+  struct token *items;
+  int count;
+  int capacity;
+};
+
+struct token_list line_tokens;
+
+// Syntax tree built by parse_line() and walked by execute_node():
+//   a; b       -> SEQUENCE(a, b)
+//   a && b     -> AND(a, b), a || b -> OR(a, b) (same precedence, left-associative)
+//   a | b | c  -> PIPELINE [a, b, c]
+//   ( list )   -> SUBSHELL(list): runs in a forked child
+//   { list; }  -> GROUP(list): runs in the shell itself
+//   a & b      -> SEQUENCE(BACKGROUND(a), b): 'a' becomes a background job
+//   time a | b -> TIME(PIPELINE [a, b]): reports the pipeline's resource usage
+// Nodes live in 'line_arena', like everything else parsed from the line.
+enum node_kind { NODE_COMMAND, NODE_PIPELINE, NODE_AND, NODE_OR, NODE_SEQUENCE, NODE_SUBSHELL, NODE_GROUP, NODE_BACKGROUND, NODE_TIME };
+
+struct node {
+  enum node_kind kind;
+  struct command cmd;   // COMMAND: argv + redirections. SUBSHELL/GROUP: redirections only
+  struct node *left;    // AND / OR / SEQUENCE
+  struct node *right;
+  struct node *body;    // SUBSHELL / GROUP / BACKGROUND / TIME (NULL: plain "time")
+  struct node **stages; // PIPELINE
+  int stage_count;
+};
+
+// A job: one pipeline (or single command, or subshell) started by the shell.
+// Foreground jobs live on the stack of the code waiting for them and only enter
+// 'job_table' if they are stopped (Ctrl+Z); background jobs go straight in.
+enum job_state { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct job {
+  int id;                 // Number shown as [N] (0 while not in the table)
+  pid_t pgid;             // Process group (job control only; 0 until the first process starts)
+  pid_t *pids;            // Slot i = stage i: 0 if not started, negated once reaped
+  int *pidfds;            // Slot i = pidfd of pids[i] while it is alive, else -1
+  int *statuses;          // Slot i = exit status of pids[i] once reaped
+  int pid_count;
+  int live_count;         // Processes not reaped yet
+  int last_status;        // Exit status of the last stage (the job's status)
+  enum job_state state;
+  int foreground;         // Owns the terminal while it runs
+  int notify;             // State changed and the user has not been told yet
+  unsigned long sequence; // The most recently started/stopped job is the current one (+)
+  struct termios tmodes;  // Terminal modes saved when the job was stopped
+  int has_tmodes;
+  char *command;          // Text for 'jobs' (malloc'ed, table copies only)
+  struct node **stages;   // Source of 'command' while the line is still running
+  int stage_count;
 };
 
+struct job **job_table; // Slot i holds job number i + 1; NULL slots are free
+int job_table_size;
+unsigned long job_sequence;
+
+int job_control;  // Interactive: jobs get their own process group and the terminal
+pid_t shell_pgid;
+struct job *foreground_job; // The job wait_for_job() is waiting for (not in the table)
+int interrupted;            // Ctrl+C during 'wait' (see events_catch_interrupt())
+
+// Exit statuses and the options that act on them
+int last_status;          // $?: status of the last command, pipeline or list that ran
+int *pipe_status;         // PIPESTATUS: one status per stage of the last pipeline
+int pipe_status_count;
+int pipe_status_capacity;
+int option_errexit;       // set -e: exit as soon as a command fails
+int option_pipefail;      // set -o pipefail: a pipeline fails if any of its stages does
+int errexit_suppressed;   // > 0 while running the left side of && / ||, whose failure is tested
+
+// Resource usage of every child reaped so far, as reported by wait4()
+struct rusage child_usage;  // CPU times summed; ru_maxrss is the largest child's (KiB)
+long child_maxrss_peak;     // Largest ru_maxrss since the innermost 'time' started
+
 // Global cache for directories found in the PATH environment variable
 char *path_dirs[MAX_PATH_ENTRIES];
 int path_count = 0;
 
+// In-memory index of the executables in each PATH directory (parallel to 'path_dirs').
+// Each directory is watched with inotify; the events are drained from the REPL loop
+// and applied to the sorted name list, so lookups and completion never touch the disk.
+// Directories that cannot be watched fall back to an mtime check before use.
+struct path_index_dir {
+  int wd;                // inotify watch descriptor, -1 if not watched
+  int dirty;             // Set when the name list must be rebuilt from scratch
+  struct timespec mtime; // Directory mtime at the last scan (used when unwatched)
+  char **names;          // Sorted names of executable files in the directory
+  int count;
+  int capacity;
+};
+
+struct path_index_dir path_index[MAX_PATH_ENTRIES];
+int inotify_fd = -1;
+unsigned long path_index_epoch = 0; // Bumped whenever any directory's names change
+
+// TAB completion list: builtins + all indexed executables, sorted and de-duplicated.
+// Entries point into builtins[] and the PATH index; rebuilt when the epoch moves on.
+char **completion_names = NULL;
+int completion_count = 0;
+int completion_capacity = 0;
+unsigned long completion_epoch = ~0UL;
+
+// Command hash table (like bash's 'hash'): remembers where each command was found
+// so repeated commands resolve without walking PATH again.
+struct cmd_hash_entry {
+  char *name;                  // Command name as typed, e.g. "ls"
+  char *path;                  // Resolved full path, e.g. "/usr/bin/ls"
+  int hits;                    // How many times the entry was used
+  struct cmd_hash_entry *next; // Next entry in the same bucket (chaining)
+};
+
+struct cmd_hash_entry *cmd_hash[CMD_HASH_BUCKETS];
+
+// Negative cache: names recently looked up and NOT found in PATH.
+// Direct-mapped (one name per slot, collisions overwrite) so it stays bounded.
+// It is flushed whenever the PATH index changes; unwatched directories are
+// re-checked by mtime before a cached miss is trusted.
+char *neg_cache[NEG_CACHE_SLOTS];
+
 // ================================================================================
 // BUILT-IN IMPLEMENTATIONS
 // ================================================================================
 
-int shell_exit(int argc, char *argv[]) {
-  // exit(0) terminates the C program immediately. 
+// --- Output sink ---
+// stdout is unbuffered (so prompts show up at once), which would cost builtins
+// one write() per printf. Their normal output is collected here instead and goes
+// out in one write() when the builtin returns (run_builtin_in_process()), or
+// earlier whenever the buffer fills up. It is written to the running builtin's
+// io->out (fd 1 otherwise). Errors go to io->err directly, with dprintf().
+// A failed write is remembered, and reported once the builtin is done.
+
+struct builtin_output {
+  char data[BUILTIN_OUT_SIZE];
+  size_t len;
+  int fd;
+  int error; // errno of the first write that failed (0: none)
+};
+
+struct builtin_output builtin_out = {.fd = STDOUT_FILENO};
+
+// Writes all of 'len' bytes (the terminal or a pipe may take them in pieces)
+int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1; // Reader gone (closed pipe): the rest is dropped, like stdio would
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Moves one of the shell's own descriptors (inotify, epoll, pidfds...) out of
+ * the low numbers scripts use for "3>file", keeping it close-on-exec.
+ * Returns the new number (the old one if there is no room up there).
+ */
+int fd_make_private(int fd) {
+  if (fd < 0 || fd >= SHELL_FD_MIN) return fd;
+  int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+  if (moved < 0) return fd;
+  close(fd);
+  return moved;
+}
+
+// Whether "N>&fd" may use 'fd': open, and not one of the shell's close-on-exec ones
+int fd_is_user_visible(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  return flags >= 0 && !(flags & FD_CLOEXEC);
+}
+
+// Returns -1 if this or an earlier write failed (see builtin_out.error)
+int out_flush() {
+  if (builtin_out.len > 0 && write_all(builtin_out.fd, builtin_out.data, builtin_out.len) < 0 && builtin_out.error == 0) {
+    builtin_out.error = errno;
+  }
+  builtin_out.len = 0;
+  return builtin_out.error ? -1 : 0;
+}
+
+void out_write(const char *data, size_t n) {
+  if (builtin_out.len + n > BUILTIN_OUT_SIZE) {
+    out_flush();
+    if (n > BUILTIN_OUT_SIZE) {
+      // Too big to buffer: straight through
+      if (write_all(builtin_out.fd, data, n) < 0 && builtin_out.error == 0) builtin_out.error = errno;
+      return;
+    }
+  }
+  memcpy(builtin_out.data + builtin_out.len, data, n);
+  builtin_out.len += n;
+}
+
+void out_puts(const char *str) {
+  out_write(str, strlen(str));
+}
+
+__attribute__((format(printf, 1, 2)))
+void out_printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t room = BUILTIN_OUT_SIZE - builtin_out.len;
+  int n = vsnprintf(builtin_out.data + builtin_out.len, room, format, args);
+  va_end(args);
+  if (n < 0) return;
+  if ((size_t)n < room) {
+    builtin_out.len += n; // The common case: formatted right into the buffer
+    return;
+  }
+
+  // Did not fit: format into a temporary and append that
+  char *text;
+  va_start(args, format);
+  n = vasprintf(&text, format, args);
+  va_end(args);
+  if (n < 0) return;
+  out_write(text, n);
+  free(text);
+}
+
+int shell_exit(int argc, char *argv[], struct builtin_io *io) {
+  int status = last_status; // Plain 'exit' keeps the status of the command before it
+  if (argc > 1) {
+    char *end;
+    long value = strtol(argv[1], &end, 10);
+    if (*argv[1] == '\0' || *end != '\0') {
+      dprintf(io->err, "exit: %s: numeric argument required\n", argv[1]);
+      value = 2;
+    }
+    status = value & 0xFF; // Exit statuses are 8 bits, as in other shells
+  }
+  out_flush();
+  // exit() terminates the C program immediately. 
   // 'atexit' (registered earlier) will trigger here to fix terminal modes.
-  exit(0);
+  exit(status);
   return 0; 
 }
 
-int shell_echo(int argc, char *argv[]) {
+int shell_echo(int argc, char *argv[], struct builtin_io *io) {
   // Simple loop starting at 1 (skipping the command name itself)
   for (int i = 1; i < argc; i++) {
-    printf("%s", argv[i]);
+    out_puts(argv[i]);
     if (i < argc - 1) {
-      printf(" "); // Add space between args, but not after the last one
+      out_write(" ", 1); // Add space between args, but not after the last one
     }
   }
-  printf("\n");
-  return 1; 
+  out_write("\n", 1);
+  return 0;
 }
 
-int shell_type(int argc, char *argv[]) {
+int shell_type(int argc, char *argv[], struct builtin_io *io) {
   if (argc < 2) {
-    printf("type: expected argument\n");
+    out_printf("type: expected argument\n");
     return 1;
   }
 
+  int status = 0;
+
   // Iterate over all arguments provided to 'type'
   for (int arg_idx = 1; arg_idx < argc; arg_idx++) {
     char *token = argv[arg_idx];
@@ -146,7 +625,7 @@ int shell_type(int argc, char *argv[]) {
     // Check if it's a built-in
     for (int i = 0; i < num_builtins(); i++) {
       if (strcmp(token, builtins[i].name) == 0) {
-        printf("%s is a shell builtin\n", token);
+        out_printf("%s is a shell builtin\n", token);
         found = 1;
         break;
       }
@@ -156,39 +635,42 @@ int shell_type(int argc, char *argv[]) {
     if (!found) {
       char *full_path = ext_check(token);
       if (full_path != NULL) {
-        printf("%s is %s\n", token, full_path);
+        out_printf("%s is %s\n", token, full_path);
         found = 1;
       }
       if (!found) {
-        printf("%s: not found\n", token);
+        out_printf("%s: not found\n", token);
+        status = 1;
       }
     }
   }
-  return 1; 
+  return status;
 }
 
-int shell_help(int argc, char *argv[]) {
-  printf("Hirbod's Shell. Built-ins available:\n");
-  printf("  cd\n  help\n  exit\n  echo\n");
-  return 1;
+int shell_help(int argc, char *argv[], struct builtin_io *io) {
+  out_printf("Hirbod's Shell. Built-ins available:\n");
+  for (int i = 0; i < num_builtins(); i++) {
+    out_printf("  %s\n", builtins[i].name);
+  }
+  return 0;
 }
 
-int shell_pwd(int argc, char *argv[]){
+int shell_pwd(int argc, char *argv[], struct builtin_io *io){
   char cwd[1024];
   // getcwd fills the array with the current working directory path
   if (getcwd(cwd, sizeof(cwd)) != NULL) {
-    printf("%s\n", cwd);
+    out_printf("%s\n", cwd);
     return 0;
   } 
   else {
-    perror("getcwd"); // Prints standard error message based on errno
-    return -1;
+    dprintf(io->err, "getcwd: %s\n", strerror(errno)); // Standard error message based on errno
+    return 1;
   }
 }
 
-int shell_cd(int argc, char *argv[]){
+int shell_cd(int argc, char *argv[], struct builtin_io *io){
   if (argc < 2) {
-    fprintf(stderr, "cd: missing argument\n");
+    dprintf(io->err, "cd: missing argument\n");
     return 1;
   }
 
@@ -199,7 +681,7 @@ int shell_cd(int argc, char *argv[]){
   if (arg[0] == '~') {
     char *home = getenv("HOME");
     if (home == NULL) {
-      fprintf(stderr, "cd: HOME not set\n");
+      dprintf(io->err, "cd: HOME not set\n");
       return 1;
     }
 
@@ -217,16 +699,310 @@ int shell_cd(int argc, char *argv[]){
 
   // chdir is the system call to change the process's working directory
   if (chdir(target_dir) != 0) {
-    fprintf(stderr, "cd: %s: No such file or directory\n", arg);
+    dprintf(io->err, "cd: %s: No such file or directory\n", arg);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * hash            -> list remembered commands and their hit counts
+ * hash name...    -> look each name up in PATH and remember it
+ * hash -d name... -> forget the given names
+ * hash -r         -> forget everything
+ */
+int shell_hash(int argc, char *argv[], struct builtin_io *io) {
+  if (argc == 1) {
+    int empty = 1;
+    for (int b = 0; b < CMD_HASH_BUCKETS; b++) {
+      for (struct cmd_hash_entry *e = cmd_hash[b]; e != NULL; e = e->next) {
+        if (empty) {
+          out_printf("hits\tcommand\n");
+          empty = 0;
+        }
+        out_printf("%4d\t%s\n", e->hits, e->path);
+      }
+    }
+    if (empty) {
+      out_printf("hash: hash table empty\n");
+    }
+    return 0;
+  }
+
+  int status = 0;
+  int delete_mode = 0;
+  int arg_idx = 1;
+
+  // Parse options (-r may be combined with names, -d changes the meaning of names)
+  for (; arg_idx < argc && argv[arg_idx][0] == '-' && argv[arg_idx][1] != '\0'; arg_idx++) {
+    for (char *opt = argv[arg_idx] + 1; *opt; opt++) {
+      if (*opt == 'r') {
+        cmd_hash_reset();
+      } else if (*opt == 'd') {
+        delete_mode = 1;
+      } else {
+        dprintf(io->err, "hash: -%c: invalid option\n", *opt);
+        dprintf(io->err, "hash: usage: hash [-r] [-d] [name ...]\n");
+        return 2;
+      }
+    }
+  }
+
+  for (; arg_idx < argc; arg_idx++) {
+    char *name = argv[arg_idx];
+
+    if (delete_mode) {
+      if (cmd_hash_delete(name) != 0) {
+        dprintf(io->err, "hash: %s: not found\n", name);
+        status = 1;
+      }
+      continue;
+    }
+
+    // Builtins and explicit paths are never hashed (same as bash)
+    int is_builtin = 0;
+    for (int i = 0; i < num_builtins(); i++) {
+      if (strcmp(name, builtins[i].name) == 0) {
+        is_builtin = 1;
+        break;
+      }
+    }
+    if (is_builtin || strchr(name, '/') != NULL) continue;
+
+    // Always re-search PATH so 'hash name' can refresh a stale entry
+    char *full_path = path_search(name);
+    if (full_path == NULL) {
+      dprintf(io->err, "hash: %s: not found\n", name);
+      status = 1;
+      continue;
+    }
+    cmd_hash_add(name, full_path);
+  }
+  return status;
+}
+
+/*
+ * memstats -> show the per-line arena counters. Running a few commands and then
+ * 'memstats' again shows whether the arena still needs malloc() in steady state.
+ */
+int shell_memstats(int argc, char *argv[], struct builtin_io *io) {
+  size_t reserved = 0;
+  size_t used = 0;
+  int blocks = 0;
+  for (struct arena_block *b = line_arena.first; b != NULL; b = b->next) {
+    reserved += b->size;
+    used += b->used;
+    blocks++;
+  }
+  out_printf("arena blocks:       %d\n", blocks);
+  out_printf("arena bytes:        %zu reserved, %zu in use\n", reserved, used);
+  out_printf("arena allocations:  %lu\n", line_arena.allocations);
+  out_printf("arena malloc calls: %lu\n", line_arena.malloc_calls);
+  out_printf("arena resets:       %lu\n", line_arena.resets);
+  return 0;
+}
+
+/*
+ * jobs -> list background and stopped jobs ([N]+ is the current job, [N]- the previous one)
+ */
+int shell_jobs(int argc, char *argv[], struct builtin_io *io) {
+  job_reap();
+  for (int j = 0; j < job_table_size; j++) {
+    struct job *job = job_table[j];
+    if (job == NULL) continue;
+    job_print(job);
+    job->notify = 0;
+    if (job->state == JOB_DONE) job_remove(job); // Reported once, then forgotten
+  }
+  return 0;
+}
+
+// fg [job] -> continue a job in the foreground and wait for it
+int shell_fg(int argc, char *argv[], struct builtin_io *io) {
+  if (!job_control) {
+    dprintf(io->err, "fg: no job control\n");
+    return 1;
+  }
+  job_reap();
+  struct job *job = job_find("fg", argc > 1 ? argv[1] : NULL, io->err);
+  if (job == NULL) return 1;
+
+  out_printf("%s\n", job->command);
+  out_flush(); // Before the job's own output
+  if (job->state != JOB_DONE) {
+    job->state = JOB_RUNNING;
+    job->foreground = 1;
+    job->sequence = ++job_sequence;
+    terminal_give_to_job(job);
+    kill(-job->pgid, SIGCONT);
+    wait_for_job(job);
+  }
+
+  int status = job->state == JOB_STOPPED ? 128 + SIGTSTP : job->last_status;
+  if (job->state == JOB_DONE) job_remove(job);
+  return status;
+}
+
+// bg [job] -> continue a stopped job in the background
+int shell_bg(int argc, char *argv[], struct builtin_io *io) {
+  if (!job_control) {
+    dprintf(io->err, "bg: no job control\n");
+    return 1;
+  }
+  job_reap();
+  struct job *job = job_find("bg", argc > 1 ? argv[1] : NULL, io->err);
+  if (job == NULL) return 1;
+
+  if (job->state == JOB_DONE) {
+    dprintf(io->err, "bg: job has terminated\n");
+    return 1;
+  }
+  if (job->state == JOB_RUNNING) {
+    dprintf(io->err, "bg: job %d already in background\n", job->id);
+    return 0;
+  }
+  job->state = JOB_RUNNING;
+  job->foreground = 0;
+  kill(-job->pgid, SIGCONT);
+  out_printf("[%d] %s &\n", job->id, job->command);
+  return 0;
+}
+
+/*
+ * wait          -> wait for every background job
+ * wait %N | PID -> wait for those jobs; the status is the last one's exit status
+ *                  (127 if it is not a job of this shell)
+ * Ctrl+C ends the wait with status 130; the jobs keep running.
+ */
+int shell_wait(int argc, char *argv[], struct builtin_io *io) {
+  job_reap();
+  events_catch_interrupt(1);
+  int status = 0;
+  if (argc == 1) {
+    for (int j = 0; j < job_table_size && !interrupted; j++) {
+      if (job_table[j] == NULL) continue;
+      job_wait_blocking(job_table[j]);
+      if (!interrupted) job_remove(job_table[j]);
+    }
+  }
+
+  for (int i = 1; i < argc && !interrupted; i++) {
+    struct job *job = NULL;
+    if (argv[i][0] == '%') {
+      job = job_find("wait", argv[i], io->err);
+    } else {
+      // A PID: the job it belongs to (reaped PIDs are kept negated)
+      pid_t pid = atoi(argv[i]);
+      for (int j = 0; j < job_table_size && job == NULL && pid > 0; j++) {
+        for (int k = 0; job_table[j] != NULL && k < job_table[j]->pid_count; k++) {
+          pid_t p = job_table[j]->pids[k];
+          if (p == pid || p == -pid) job = job_table[j];
+        }
+      }
+      if (job == NULL) {
+        dprintf(io->err, "wait: pid %s is not a child of this shell\n", argv[i]);
+      }
+    }
+
+    if (job == NULL) {
+      status = 127;
+      continue;
+    }
+    status = job_wait_blocking(job);
+    if (!interrupted) job_remove(job);
+  }
+
+  if (interrupted) {
+    dprintf(io->err, "\n"); // After the ^C the terminal would have echoed
+    status = 128 + SIGINT;
+  }
+  events_catch_interrupt(0);
+  return status;
+}
+
+/*
+ * set -e | +e              -> exit when a command fails (errexit) / don't
+ * set -o | +o NAME         -> turn option NAME (errexit, pipefail) on / off
+ * set -o  (or just 'set')  -> list the options
+ */
+int shell_set(int argc, char *argv[], struct builtin_io *io) {
+  struct { const char *name; int *value; } options[] = {
+    {"errexit", &option_errexit},
+    {"pipefail", &option_pipefail},
+  };
+  int option_count = sizeof(options) / sizeof(options[0]);
+  int list = argc == 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if ((arg[0] != '-' && arg[0] != '+') || arg[1] == '\0') {
+      dprintf(io->err, "set: %s: invalid argument\n", arg);
+      return 2;
+    }
+    int on = arg[0] == '-';
+    for (const char *flag = arg + 1; *flag; flag++) {
+      if (*flag == 'e') {
+        option_errexit = on;
+      } else if (*flag == 'o') {
+        if (i + 1 >= argc) {
+          list = 1;
+          continue;
+        }
+        const char *name = argv[++i];
+        int found = 0;
+        for (int k = 0; k < option_count; k++) {
+          if (strcmp(name, options[k].name) == 0) {
+            *options[k].value = on;
+            found = 1;
+          }
+        }
+        if (!found) {
+          dprintf(io->err, "set: %s: invalid option name\n", name);
+          return 2;
+        }
+      } else {
+        dprintf(io->err, "set: %c%c: invalid option\n", arg[0], *flag);
+        return 2;
+      }
+    }
+  }
+
+  if (list) {
+    for (int k = 0; k < option_count; k++) {
+      out_printf("%-15s\t%s\n", options[k].name, *options[k].value ? "on" : "off");
+    }
   }
+  return 0;
+}
 
-  return 1; 
+// times -> user and system time used by the shell, then by all of its children
+int shell_times(int argc, char *argv[], struct builtin_io *io) {
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  char text[4][32];
+  format_duration(text[0], sizeof(text[0]), timeval_seconds(self.ru_utime));
+  format_duration(text[1], sizeof(text[1]), timeval_seconds(self.ru_stime));
+  format_duration(text[2], sizeof(text[2]), timeval_seconds(child_usage.ru_utime));
+  format_duration(text[3], sizeof(text[3]), timeval_seconds(child_usage.ru_stime));
+  out_printf("%s %s\n%s %s\n", text[0], text[1], text[2], text[3]);
+  return 0;
 }
 
 int num_builtins() {
   return sizeof(builtins) / sizeof(struct builtin);
 }
 
+// Returns the builtin's function, or NULL if 'name' is not a builtin.
+builtin_func find_builtin(const char *name) {
+  for (int i = 0; i < num_builtins(); i++) {
+    if (strcmp(name, builtins[i].name) == 0) {
+      return builtins[i].func;
+    }
+  }
+  return NULL;
+}
+
 // ================================================================================
 // PATH PARSING & EXECUTABLE FINDING
 // ================================================================================
@@ -257,616 +1033,4031 @@ void parse_path(char *path_string) {
 }
 
 /*
- * Checks if a program exists in any of the directories stored in 'path_dirs'.
- * Returns the full path string if found and executable, NULL otherwise.
+ * Looks for an executable in the PATH index, honouring PATH order.
+ * Returns the full path string if found, NULL otherwise.
+ * Callers normally go through ext_check(), which adds hashing on top.
  */
-char* ext_check(char *program_name){
+char* path_search(const char *program_name){
   for (int i = 0; i < path_count; i++){
-    static char full_path[1024]; // Static buffer avoids repeated stack allocation
-    
-    // Construct /usr/bin/ls
-    snprintf(full_path, sizeof(full_path), "%s/%s", path_dirs[i], program_name);
-    
-    // access() checks file accessibility. F_OK = Exists, X_OK = Executable permissions.
-    if (access(full_path, F_OK) == 0 && access(full_path, X_OK) == 0){
+    if (path_index_contains(i, program_name)){
+      static char full_path[1024]; // Static buffer avoids repeated stack allocation
+      // Construct /usr/bin/ls
+      snprintf(full_path, sizeof(full_path), "%s/%s", path_dirs[i], program_name);
       return full_path;
     }
   }
   return NULL;
 }
 
-// Helper for Tab Completion
-int compare_strings(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
-}
-
-int get_completions(const char *prefix, char ***out_matches) {
-    size_t prefix_len = strlen(prefix);
-    if (prefix_len == 0) return 0;
+/*
+ * Resolves a command name to the full path of an executable.
+ * Names containing '/' are used as-is. Everything else goes through the command
+ * hash table first, so only the first lookup of a command pays for the PATH walk.
+ * Misses are remembered in the negative cache, so repeating a typo costs one
+ * probe (plus a stat() per unwatched PATH directory) instead of a full walk.
+ * Returns NULL if nothing executable was found.
+ */
+char* ext_check(char *program_name){
+  if (strchr(program_name, '/') != NULL) {
+    return access(program_name, X_OK) == 0 ? program_name : NULL;
+  }
 
-    int capacity = 10;
-    int count = 0;
-    char **matches = malloc(capacity * sizeof(char *));
+  struct cmd_hash_entry *entry = cmd_hash_find(program_name);
+  if (entry == NULL) {
+    // Pick up anything installed since the last prompt before declaring a miss
+    path_index_drain();
 
-    // Builtins
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strncmp(builtins[i].name, prefix, prefix_len) == 0) {
-            if (count >= capacity) {
-                capacity *= 2;
-                matches = realloc(matches, capacity * sizeof(char *));
-            }
-            matches[count++] = strdup(builtins[i].name);
-        }
+    if (neg_cache_lookup(program_name)) {
+      // Still missing unless an unwatched PATH directory changed meanwhile
+      // (path_dirs_changed() drops the stale entries in that case)
+      if (!path_dirs_changed()) return NULL;
     }
 
-    // Executables
-    for (int i = 0; i < path_count; i++) {
-        DIR *d = opendir(path_dirs[i]);
-        if (d == NULL) continue;
-
-        struct dirent *dir;
-        while ((dir = readdir(d)) != NULL) {
-            if (strncmp(dir->d_name, prefix, prefix_len) == 0) {
-                char full_path[1024];
-                snprintf(full_path, sizeof(full_path), "%s/%s", path_dirs[i], dir->d_name);
-                
-                if (access(full_path, X_OK) == 0) {
-                    // Check duplicates
-                    int exists = 0;
-                    for (int j = 0; j < count; j++) {
-                        if (strcmp(matches[j], dir->d_name) == 0) {
-                            exists = 1;
-                            break;
-                        }
-                    }
-                    if (!exists) {
-                        if (count >= capacity) {
-                            capacity *= 2;
-                            matches = realloc(matches, capacity * sizeof(char *));
-                        }
-                        matches[count++] = strdup(dir->d_name);
-                    }
-                }
-            }
-        }
-        closedir(d);
+    char *full_path = path_search(program_name);
+    if (full_path == NULL) {
+      neg_cache_insert(program_name);
+      return NULL;
     }
-
-    qsort(matches, count, sizeof(char *), compare_strings);
-    *out_matches = matches;
-    return count;
+    entry = cmd_hash_add(program_name, full_path);
+    if (entry == NULL) return full_path; // Out of memory: still usable, just not remembered
+  }
+  entry->hits++;
+  return entry->path;
 }
 
 // ================================================================================
-// FILE DESCRIPTOR MANIPULATION (REDIRECTION)
+// COMMAND HASH TABLE
 // ================================================================================
+// A small chained hash table mapping command names to resolved paths.
 
-/*
- * Logic for replacing a standard FD (stdin/stdout/stderr) with a file.
- * Returns -1 on failure, 0 on success.
- */
-int setup_redirect_fd(const char *path, int target_fd, int should_exit_on_error, int append_mode) {
-  // O_WRONLY: Write only
-  // O_CREAT: Create file if missing
-  // O_APPEND vs O_TRUNC: Append adds to end, Truncate wipes file first (>> vs >)
-  int flags = O_WRONLY | O_CREAT | (append_mode ? O_APPEND : O_TRUNC);
-  
-  // 0666 gives read/write permissions to user/group/others
-  int fd = open(path, flags, 0666);
-  if (fd < 0) {
-    perror("open");
-    if (should_exit_on_error) exit(1);
-    return -1;
+// FNV-1a: simple, fast and good enough for short command names
+unsigned int hash_string(const char *s) {
+  unsigned int h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
   }
-  
-  // dup2(old, new) closes 'new' if open, and makes 'new' point to 'old' file table entry.
-  // Effectively: "Make StdOut point to this file we just opened."
-  if (dup2(fd, target_fd) < 0) {
-    perror("dup2");
-    close(fd);
-    if (should_exit_on_error) exit(1);
-    return -1;
+  return h;
+}
+
+struct cmd_hash_entry* cmd_hash_find(const char *name) {
+  unsigned int bucket = hash_string(name) % CMD_HASH_BUCKETS;
+  for (struct cmd_hash_entry *e = cmd_hash[bucket]; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) return e;
   }
-  
-  close(fd); // We can close the original file handle now, the duplicated one remains.
-  return 0;
+  return NULL;
 }
 
 /*
- * Saves the current state of a file descriptor (like stdout) before we redirect it,
- * so we can restore it after the command finishes.
+ * Adds (or replaces) the entry for 'name'. Both strings are copied.
+ * Returns the entry, or NULL if memory could not be allocated.
  */
-int save_and_redirect_fd(const char *path, int target_fd, int append_mode) {
-  int saved_fd = dup(target_fd); // Create a backup of stdout (usually fd 1)
-  if (saved_fd < 0) {
-    perror("dup");
-    return -1;
+struct cmd_hash_entry* cmd_hash_add(const char *name, const char *path) {
+  struct cmd_hash_entry *e = cmd_hash_find(name);
+  if (e != NULL) {
+    char *new_path = strdup(path);
+    if (!new_path) return NULL;
+    free(e->path);
+    e->path = new_path;
+    e->hits = 0;
+    return e;
   }
-  if (setup_redirect_fd(path, target_fd, 0, append_mode) < 0) {
-    close(saved_fd);
-    return -1;
+
+  e = malloc(sizeof(*e));
+  if (!e) return NULL;
+  e->name = strdup(name);
+  e->path = strdup(path);
+  if (!e->name || !e->path) {
+    free(e->name);
+    free(e->path);
+    free(e);
+    return NULL;
   }
-  return saved_fd;
+  e->hits = 0;
+
+  // Insert at the head of the bucket
+  unsigned int bucket = hash_string(name) % CMD_HASH_BUCKETS;
+  e->next = cmd_hash[bucket];
+  cmd_hash[bucket] = e;
+  return e;
 }
 
-void restore_fd(int saved_fd, int target_fd) {
-  if (saved_fd != -1) {
-    dup2(saved_fd, target_fd); // Restore stdout to point back to the terminal
-    close(saved_fd); // Close the backup
+// Returns 0 if the entry was removed, -1 if it was not in the table.
+int cmd_hash_delete(const char *name) {
+  unsigned int bucket = hash_string(name) % CMD_HASH_BUCKETS;
+  for (struct cmd_hash_entry **link = &cmd_hash[bucket]; *link != NULL; link = &(*link)->next) {
+    struct cmd_hash_entry *e = *link;
+    if (strcmp(e->name, name) == 0) {
+      *link = e->next; // Unlink from the chain
+      free(e->name);
+      free(e->path);
+      free(e);
+      return 0;
+    }
   }
+  return -1;
 }
 
-// ================================================================================
-// EXTERNAL PROGRAM EXECUTION
-// ================================================================================
-
-void execute_external_program(char *full_path, int argc, char *argv[], char *redirect_out, char *redirect_err, int redirect_out_append, int redirect_err_append) {
-    argv[argc] = NULL; // execv requires the array to be null-terminated
-
-    // Fork creates a clone of the current process.
-    // Parent process gets the child's PID. Child process gets 0.
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        perror("fork");
-        return;
-    } else if (pid == 0) {
-      // === CHILD PROCESS ===
-      // This is where we run the new program.
-      
-      // Handle redirections *inside* the child so the parent shell isn't affected
-      if (redirect_out != NULL) {
-        setup_redirect_fd(redirect_out, STDOUT_FILENO, 1, redirect_out_append);
-      }
-      if (redirect_err != NULL) {
-        setup_redirect_fd(redirect_err, STDERR_FILENO, 1, redirect_err_append);
-      }
-      
-      // execv replaces the current process memory with the new program.
-      // If successful, this function never returns.
-      execv(full_path, argv);
-        
-      // If we are here, execv failed (e.g., permission denied)
-      perror("execv");
-      exit(1);
-    } else {
-        // === PARENT PROCESS ===
-        // Wait for the child (pid) to finish so the prompt doesn't appear prematurely.
-        int status;
-        waitpid(pid, &status, 0);
+void cmd_hash_reset() {
+  for (int b = 0; b < CMD_HASH_BUCKETS; b++) {
+    struct cmd_hash_entry *e = cmd_hash[b];
+    while (e != NULL) {
+      struct cmd_hash_entry *next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      e = next;
     }
+    cmd_hash[b] = NULL;
+  }
+  neg_cache_reset();
+}
+
+// ================================================================================
+// NEGATIVE LOOKUP CACHE ("command not found")
+// ================================================================================
+
+int neg_cache_lookup(const char *name) {
+  char *slot = neg_cache[hash_string(name) % NEG_CACHE_SLOTS];
+  return slot != NULL && strcmp(slot, name) == 0;
+}
+
+void neg_cache_insert(const char *name) {
+  char **slot = &neg_cache[hash_string(name) % NEG_CACHE_SLOTS];
+  char *copy = strdup(name);
+  if (!copy) return; // Not caching is always safe
+  free(*slot); // Evict whatever was there before
+  *slot = copy;
+}
+
+void neg_cache_reset() {
+  for (int i = 0; i < NEG_CACHE_SLOTS; i++) {
+    free(neg_cache[i]);
+    neg_cache[i] = NULL;
+  }
+}
+
+// ================================================================================
+// PATH INDEX (inotify-maintained list of executables per PATH directory)
+// ================================================================================
+
+/*
+ * For a directory without an inotify watch, stat()s it and compares the mtime
+ * with the one recorded at the last scan (adding/removing a file updates it).
+ * Marks the directory dirty and returns 1 if it changed. Watched directories
+ * are kept current by path_index_drain() and always return 0.
+ * A directory that cannot be stat'ed is recorded as a zero mtime, so it counts
+ * as changed once it appears.
+ */
+int path_index_check_mtime(int dir_idx) {
+  struct path_index_dir *dir = &path_index[dir_idx];
+  if (dir->wd >= 0) return 0;
+
+  struct stat st;
+  struct timespec now = {0, 0};
+  if (stat(path_dirs[dir_idx], &st) == 0) {
+    now = st.st_mtim;
+  }
+  if (now.tv_sec == dir->mtime.tv_sec && now.tv_nsec == dir->mtime.tv_nsec) return 0;
+
+  dir->dirty = 1;
+  return 1;
+}
+
+/*
+ * Checks every unwatched PATH directory for changes.
+ * Returns 1 (and flushes the negative cache) if any of them changed.
+ */
+int path_dirs_changed() {
+  int changed = 0;
+  for (int i = 0; i < path_count; i++) {
+    changed |= path_index_check_mtime(i);
+  }
+  if (changed) neg_cache_reset();
+  return changed;
+}
+
+/*
+ * Decides whether 'name' inside the directory is something we can run:
+ * a regular file (following symlinks) with execute permission.
+ * d_type lets us skip the stat for the common cases.
+ */
+int path_index_is_executable(int dir_fd, const char *name, unsigned char d_type) {
+  if (d_type == DT_DIR) return 0;
+  if (d_type != DT_REG) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode)) return 0;
+  }
+  return faccessat(dir_fd, name, X_OK, 0) == 0;
+}
+
+// Binary search over a sorted string array: index of the first name >= key (== count if none)
+int sorted_lower_bound(char **names, int count, const char *key) {
+  int lo = 0, hi = count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp(names[mid], key) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int path_index_lower_bound(struct path_index_dir *dir, const char *key) {
+  return sorted_lower_bound(dir->names, dir->count, key);
+}
+
+void path_index_insert(struct path_index_dir *dir, const char *name) {
+  int pos = path_index_lower_bound(dir, name);
+  if (pos < dir->count && strcmp(dir->names[pos], name) == 0) return; // Already present
+
+  if (dir->count >= dir->capacity) {
+    int new_capacity = dir->capacity ? dir->capacity * 2 : 64;
+    char **grown = realloc(dir->names, new_capacity * sizeof(char *));
+    if (!grown) return;
+    dir->names = grown;
+    dir->capacity = new_capacity;
+  }
+  char *copy = strdup(name);
+  if (!copy) return;
+
+  // Shift the tail right to keep the array sorted
+  memmove(&dir->names[pos + 1], &dir->names[pos], (dir->count - pos) * sizeof(char *));
+  dir->names[pos] = copy;
+  dir->count++;
+}
+
+void path_index_remove(struct path_index_dir *dir, const char *name) {
+  int pos = path_index_lower_bound(dir, name);
+  if (pos >= dir->count || strcmp(dir->names[pos], name) != 0) return;
+
+  free(dir->names[pos]);
+  memmove(&dir->names[pos], &dir->names[pos + 1], (dir->count - pos - 1) * sizeof(char *));
+  dir->count--;
+}
+
+/*
+ * Rebuilds the name list of one directory from scratch and (re)arms its watch.
+ * The mtime is recorded BEFORE reading so a file added mid-scan triggers another scan.
+ */
+void path_index_scan(int dir_idx) {
+  struct path_index_dir *dir = &path_index[dir_idx];
+
+  for (int i = 0; i < dir->count; i++) {
+    free(dir->names[i]);
+  }
+  dir->count = 0;
+  dir->dirty = 0;
+  path_index_epoch++;
+
+  if (inotify_fd >= 0 && dir->wd < 0) {
+    dir->wd = inotify_add_watch(inotify_fd, path_dirs[dir_idx],
+                                IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  }
+
+  struct stat st;
+  dir->mtime = (struct timespec){0, 0};
+  if (stat(path_dirs[dir_idx], &st) == 0) {
+    dir->mtime = st.st_mtim;
+  }
+
+  DIR *d = opendir(path_dirs[dir_idx]);
+  if (d == NULL) return;
+
+  int dir_fd = dirfd(d);
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' ||
+        (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+      continue; // Skip "." and ".."
+    }
+    if (!path_index_is_executable(dir_fd, entry->d_name, entry->d_type)) continue;
+
+    if (dir->count >= dir->capacity) {
+      int new_capacity = dir->capacity ? dir->capacity * 2 : 64;
+      char **grown = realloc(dir->names, new_capacity * sizeof(char *));
+      if (!grown) break;
+      dir->names = grown;
+      dir->capacity = new_capacity;
+    }
+    char *copy = strdup(entry->d_name);
+    if (!copy) break;
+    dir->names[dir->count++] = copy;
+  }
+  closedir(d);
+
+  if (dir->count > 1) {
+    qsort(dir->names, dir->count, sizeof(char *), compare_strings);
+  }
+}
+
+/*
+ * Makes sure a directory's name list is current (rescanning if needed).
+ * Costs nothing for watched directories and one stat() for unwatched ones.
+ */
+void path_index_refresh(int dir_idx) {
+  path_index_check_mtime(dir_idx);
+  if (path_index[dir_idx].dirty) {
+    path_index_scan(dir_idx);
+  }
+}
+
+int path_index_contains(int dir_idx, const char *name) {
+  path_index_refresh(dir_idx);
+  struct path_index_dir *dir = &path_index[dir_idx];
+  int pos = path_index_lower_bound(dir, name);
+  return pos < dir->count && strcmp(dir->names[pos], name) == 0;
+}
+
+/*
+ * Sets up the inotify instance and scans every PATH directory once.
+ * If inotify is unavailable every directory simply stays in mtime mode.
+ */
+void path_index_init() {
+  inotify_fd = fd_make_private(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  for (int i = 0; i < path_count; i++) {
+    path_index[i].wd = -1;
+    path_index_scan(i);
+  }
+}
+
+/*
+ * Applies one inotify event to every PATH entry sharing the watch
+ * (the same directory can appear in PATH twice, and then shares one wd).
+ */
+void path_index_apply_event(struct inotify_event *ev) {
+  for (int i = 0; i < path_count; i++) {
+    struct path_index_dir *dir = &path_index[i];
+    if (dir->wd != ev->wd) continue;
+
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+      // The directory itself went away: drop the watch and fall back to mtime checks
+      if (ev->mask & IN_IGNORED) dir->wd = -1;
+      dir->dirty = 1;
+      continue;
+    }
+    if (ev->len == 0) continue;
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      path_index_remove(dir, ev->name);
+    } else {
+      // Created, moved in or chmod'ed: re-check whether it is runnable now
+      int dir_fd = open(path_dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir_fd < 0) {
+        dir->dirty = 1;
+        continue;
+      }
+      if (path_index_is_executable(dir_fd, ev->name, DT_UNKNOWN)) {
+        path_index_insert(dir, ev->name);
+      } else {
+        path_index_remove(dir, ev->name);
+      }
+      close(dir_fd);
+    }
+  }
+}
+
+/*
+ * Reads all pending inotify events without blocking and applies them.
+ * Any change forgets the hashed location of the affected name (it may now be
+ * shadowed or gone) and flushes the negative cache.
+ */
+void path_index_drain() {
+  if (inotify_fd < 0) return;
+
+  // Buffer must be aligned for struct inotify_event
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+
+  while (1) {
+    ssize_t n = read(inotify_fd, buf, sizeof(buf));
+    if (n <= 0) break; // EAGAIN: nothing (more) pending
+
+    for (char *p = buf; p < buf + n; ) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost: rescan everything lazily
+        for (int i = 0; i < path_count; i++) {
+          path_index[i].dirty = 1;
+        }
+        cmd_hash_reset();
+      } else {
+        path_index_apply_event(ev);
+        if (ev->len > 0) cmd_hash_delete(ev->name);
+      }
+      changed = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  if (changed) {
+    path_index_epoch++;
+    neg_cache_reset();
+  }
+}
+
+// Helper for Tab Completion
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * Rebuilds the completion list: every builtin and every indexed executable,
+ * sorted and with duplicates (same name in several PATH directories) collapsed.
+ * Only runs when the PATH index changed since the last build.
+ */
+void completion_index_rebuild() {
+    int total = num_builtins();
+    for (int i = 0; i < path_count; i++) {
+        total += path_index[i].count;
+    }
+
+    if (total > completion_capacity) {
+        char **grown = realloc(completion_names, total * sizeof(char *));
+        if (!grown) {
+            completion_count = 0;
+            return;
+        }
+        completion_names = grown;
+        completion_capacity = total;
+    }
+
+    int n = 0;
+    for (int i = 0; i < num_builtins(); i++) {
+        completion_names[n++] = builtins[i].name;
+    }
+    for (int i = 0; i < path_count; i++) {
+        for (int k = 0; k < path_index[i].count; k++) {
+            completion_names[n++] = path_index[i].names[k];
+        }
+    }
+    qsort(completion_names, n, sizeof(char *), compare_strings);
+
+    // Duplicates are now adjacent: keep the first of each run
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(completion_names[unique - 1], completion_names[i]) != 0) {
+            completion_names[unique++] = completion_names[i];
+        }
+    }
+    completion_count = unique;
+    completion_epoch = path_index_epoch;
+}
+
+/*
+ * Finds every command name starting with 'prefix'.
+ * The completion list is sorted, so the matches are one contiguous run found with
+ * a binary search: O(log n + results). '*out_matches' points INTO that list and
+ * stays valid until the PATH index changes; the caller must not free it.
+ */
+int get_completions(const char *prefix, char ***out_matches) {
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len == 0) return 0;
+
+    path_index_drain(); // Make freshly installed programs completable
+    for (int i = 0; i < path_count; i++) {
+        path_index_refresh(i); // Only stats directories without a watch
+    }
+    if (completion_epoch != path_index_epoch) {
+        completion_index_rebuild();
+    }
+
+    int lo = sorted_lower_bound(completion_names, completion_count, prefix);
+    int hi = lo;
+    while (hi < completion_count && strncmp(completion_names[hi], prefix, prefix_len) == 0) {
+        hi++;
+    }
+
+    *out_matches = &completion_names[lo];
+    return hi - lo;
+}
+
+// ================================================================================
+// FILE DESCRIPTOR MANIPULATION (REDIRECTION)
+// ================================================================================
+
+// open() flags for an output redirection
+int redirect_flags(int append_mode) {
+  // O_WRONLY: Write only
+  // O_CREAT: Create file if missing
+  // O_APPEND vs O_TRUNC: Append adds to end, Truncate wipes file first (>> vs >)
+  return O_WRONLY | O_CREAT | (append_mode ? O_APPEND : O_TRUNC);
+}
+
+/*
+ * Returns a descriptor (O_CLOEXEC) that reads 'data', for a heredoc or
+ * here-string. Small texts go through a pipe: one write of at most PIPE_BUF
+ * into an empty pipe never blocks. Bigger ones go into a memfd, which lives in
+ * memory only, so no temp file is ever created or removed.
+ * Returns -1 (reported) on failure.
+ */
+int heredoc_fd(const char *data) {
+  size_t len = strlen(data);
+  if (len <= PIPE_BUF) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+      perror("pipe");
+      return -1;
+    }
+    write_all(fds[1], data, len);
+    close(fds[1]); // The reader sees EOF right after the text
+    return fd_make_private(fds[0]);
+  }
+
+  int fd = fd_make_private(memfd_create("heredoc", MFD_CLOEXEC));
+  if (fd < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+  // pwrite() leaves the offset at 0, where the reader must start
+  for (size_t off = 0; off < len;) {
+    ssize_t n = pwrite(fd, data + off, len - off, off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      close(fd);
+      return -1;
+    }
+    off += n;
+  }
+  return fd;
+}
+
+// ================================================================================
+// PROCESS SPAWNING
+// ================================================================================
+
+void select_spawn_backend(const char *name) {
+  if (name == NULL || strcmp(name, "posix_spawn") == 0) {
+    spawn_backend = SPAWN_POSIX_SPAWN;
+  } else if (strcmp(name, "fork") == 0) {
+    spawn_backend = SPAWN_FORK;
+  } else {
+    fprintf(stderr, "Warning: unknown SHELL_SPAWN backend '%s', using posix_spawn\n", name);
+    spawn_backend = SPAWN_POSIX_SPAWN;
+  }
+}
+
+// Performs one fd action in the current process. Returns -1 (reported) on failure.
+int apply_fd_action(struct fd_action *a) {
+  if (a->kind == FD_ACTION_OPEN) {
+    int fd = open(a->path, a->flags, 0666);
+    if (fd < 0) {
+      fprintf(stderr, "shell: %s: %s\n", a->path, strerror(errno));
+      return -1;
+    }
+    if (fd != a->fd) {
+      if (dup2(fd, a->fd) < 0) {
+        perror("dup2");
+        close(fd);
+        return -1;
+      }
+      close(fd);
+    }
+  } else if (a->kind == FD_ACTION_DUP2) {
+    // "2>&7" with no fd 7, or with 7 being one of the shell's own
+    if ((!(a->flags & FD_SOURCE_SHELL) && !fd_is_user_visible(a->src_fd)) || dup2(a->src_fd, a->fd) < 0) {
+      fprintf(stderr, "shell: %d: %s\n", a->src_fd, strerror(EBADF));
+      return -1;
+    }
+  } else if (a->kind == FD_ACTION_DATA) {
+    int fd = heredoc_fd(a->path);
+    if (fd < 0) return -1;
+    if (fd == a->fd) {
+      fcntl(fd, F_SETFD, 0); // Landed on the target itself: it must survive exec
+    } else {
+      if (dup2(fd, a->fd) < 0) {
+        perror("dup2");
+        close(fd);
+        return -1;
+      }
+      close(fd);
+    }
+  } else {
+    close(a->fd); // Closing what is not open ("3>&-") is not an error
+  }
+  return 0;
+}
+
+/*
+ * Performs the fd actions in the current process (the child, for the fork backend).
+ * Exits on failure: a child with half-applied redirections must not run the program.
+ */
+void apply_fd_actions(struct fd_action *actions, int action_count) {
+  for (int i = 0; i < action_count; i++) {
+    if (apply_fd_action(&actions[i]) < 0) exit(1);
+  }
+}
+
+pid_t spawn_with_fork(const char *full_path, char *argv[], struct fd_action *actions, int action_count, struct job *job) {
+  // Fork creates a clone of the current process.
+  // Parent process gets the child's PID. Child process gets 0.
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    spawn_failure_status = 126;
+    return -1;
+  }
+  if (pid == 0) {
+    // === CHILD PROCESS ===
+    job_enter_group_in_child(job);
+
+    // Handle redirections *inside* the child so the parent shell isn't affected
+    apply_fd_actions(actions, action_count);
+
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL); // The shell's blocked SIGCHLD is not for the program
+
+    // execv replaces the current process memory with the new program.
+    // If successful, this function never returns.
+    execv(full_path, argv);
+
+    // If we are here, execv failed (e.g., permission denied)
+    int err = errno;
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    _exit(err == ENOENT ? 127 : 126); // Same statuses posix_spawn failures get
+  }
+  return pid;
+}
+
+pid_t spawn_with_posix_spawn(const char *full_path, char *argv[], struct fd_action *actions, int action_count, struct job *job) {
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+
+  // The shell keeps SIGCHLD blocked (see EVENT LOOP); programs start with nothing blocked
+  sigset_t empty;
+  sigemptyset(&empty);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  short flags = POSIX_SPAWN_SETSIGMASK;
+
+  if (job != NULL && job_control) {
+    // Same as job_enter_group_in_child(), done by posix_spawn in the child
+    sigset_t defaults;
+    job_signal_set(&defaults);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, job->pgid); // 0: new group led by the child
+    flags |= POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF;
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    if (job->foreground && job->pgid == 0) {
+      // Take the terminal before any fd action can replace stdin. Without this
+      // (older glibc) only the parent's tcsetpgrp() does it, slightly later.
+      posix_spawn_file_actions_addtcsetpgrp_np(&file_actions, STDIN_FILENO);
+    }
+#endif
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  // Redirection targets and heredoc texts are opened here and the child gets a
+  // dup2 of each: a failure from inside posix_spawn() could not be told apart
+  // from an exec error. They go above the user's fds so no later action clobbers them.
+  int *own_fds = NULL;
+  int own_count = 0;
+  int failed = 0;
+
+  for (int i = 0; i < action_count && !failed; i++) {
+    struct fd_action *a = &actions[i];
+    if (a->kind == FD_ACTION_OPEN || a->kind == FD_ACTION_DATA) {
+      if (own_fds == NULL) own_fds = arena_alloc(&line_arena, action_count * sizeof(int));
+      int fd = a->kind == FD_ACTION_DATA ? heredoc_fd(a->path) : fd_make_private(open(a->path, a->flags | O_CLOEXEC, 0666));
+      if (fd < 0) {
+        if (a->kind == FD_ACTION_OPEN) fprintf(stderr, "shell: %s: %s\n", a->path, strerror(errno));
+        failed = 1;
+        break;
+      }
+      own_fds[own_count++] = fd;
+      posix_spawn_file_actions_adddup2(&file_actions, fd, a->fd);
+    } else if (a->kind == FD_ACTION_DUP2) {
+      // The source is open if an earlier action made it, or else if the shell has
+      // it (and, for one the user named, it is not one of the shell's own)
+      int j = i - 1;
+      while (j >= 0 && actions[j].fd != a->src_fd) j--;
+      int usable = j >= 0 ? actions[j].kind != FD_ACTION_CLOSE
+                 : a->flags & FD_SOURCE_SHELL ? fcntl(a->src_fd, F_GETFD) >= 0
+                 : fd_is_user_visible(a->src_fd);
+      if (!usable) {
+        fprintf(stderr, "shell: %d: %s\n", a->src_fd, strerror(EBADF)); // Same as apply_fd_action()
+        failed = 1;
+        break;
+      }
+      posix_spawn_file_actions_adddup2(&file_actions, a->src_fd, a->fd);
+    } else {
+      posix_spawn_file_actions_addclose(&file_actions, a->fd);
+    }
+  }
+
+  pid_t pid;
+  // What can still fail in the child (the exec itself) is reported back here as an error number
+  int err = failed ? 0 : posix_spawn(&pid, full_path, &file_actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&file_actions);
+  posix_spawnattr_destroy(&attr);
+  for (int i = 0; i < own_count; i++) {
+    close(own_fds[i]);
+  }
+
+  if (failed) {
+    spawn_failure_status = 1;
+    return -1;
+  }
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    spawn_failure_status = err == ENOENT ? 127 : 126;
+    return -1;
+  }
+  return pid;
+}
+
+/*
+ * Starts 'full_path' with the given argv (must be NULL-terminated) after applying
+ * the fd actions in the child. With job control, the child is placed in 'job's
+ * process group (NULL: stay in the shell's). The caller records the PID with
+ * job_add_process(). Returns the child's PID, or -1 if it could not start
+ * (with the status to report in 'spawn_failure_status').
+ */
+pid_t spawn_program(const char *full_path, char *argv[], struct fd_action *actions, int action_count, struct job *job) {
+  if (spawn_backend == SPAWN_FORK) {
+    return spawn_with_fork(full_path, argv, actions, action_count, job);
+  }
+  return spawn_with_posix_spawn(full_path, argv, actions, action_count, job);
+}
+
+// ================================================================================
+// EXTERNAL PROGRAM EXECUTION
+// ================================================================================
+
+// Runs the program and waits for it. Returns its exit status (see 'spawn_failure_status' if it could not start).
+int execute_external_program(char *full_path, struct command *cmd) {
+    cmd->argv[cmd->argc] = NULL; // execv requires the array to be null-terminated
+
+    // A job of its own (for 'jobs' after a Ctrl+Z); its text comes from this command
+    struct node node = {.kind = NODE_COMMAND, .cmd = *cmd};
+    struct node *stage = &node;
+    struct job job;
+    job_init(&job, &stage, 1, 1);
+    terminal_give_to_job(&job);
+
+    // Redirections are applied *inside* the child so the parent shell isn't affected
+    pid_t pid = spawn_program(full_path, cmd->argv, cmd->redirects, cmd->redirect_count, &job);
+    if (pid < 0) {
+      job.last_status = spawn_failure_status;
+    } else {
+      job_add_process(&job, 0, pid);
+    }
+
+    // Wait for the child (pid) to finish so the prompt doesn't appear prematurely.
+    return wait_for_job(&job);
+}
+
+// ================================================================================
+// PER-LINE ARENA
+// ================================================================================
+
+struct arena_block *arena_new_block(struct arena *arena, size_t min_size) {
+  size_t size = ARENA_MIN_BLOCK;
+  while (size < min_size) size *= 2;
+
+  struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+  if (!block) {
+    perror("malloc");
+    exit(1); // Parsing cannot continue without memory
+  }
+  arena->malloc_calls++;
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+/*
+ * Returns 'size' bytes aligned for any type. Never returns NULL (exits on OOM).
+ * Moves on to the next kept block (or grabs a new, bigger one) when full.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+  size_t align = _Alignof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+  arena->allocations++;
+
+  if (arena->current == NULL) {
+    arena->first = arena->current = arena_new_block(arena, size);
+  }
+  while (arena->current->used + size > arena->current->size) {
+    if (arena->current->next == NULL) {
+      // Geometric growth: a line that outgrew the arena is likely to come back
+      size_t want = arena->current->size * 2;
+      arena->current->next = arena_new_block(arena, want > size ? want : size);
+    }
+    arena->current = arena->current->next;
+  }
+
+  void *ptr = arena->current->data + arena->current->used;
+  arena->current->used += size;
+  return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+  size_t len = strlen(str);
+  char *copy = arena_alloc(arena, len + 1);
+  memcpy(copy, str, len + 1);
+  return copy;
+}
+
+/*
+ * Releases everything allocated since the last reset. Blocks are kept; if a line
+ * needed several of them, they are merged into one block of the combined size so
+ * the next line of that size fits without walking (or allocating) a chain.
+ */
+void arena_reset(struct arena *arena) {
+  arena->resets++;
+  if (arena->first == NULL) return;
+
+  if (arena->first->next != NULL) {
+    size_t total = 0;
+    struct arena_block *b = arena->first;
+    while (b != NULL) {
+      struct arena_block *next = b->next;
+      total += b->size;
+      free(b);
+      b = next;
+    }
+    arena->first = arena_new_block(arena, total);
+  }
+  arena->first->used = 0;
+  arena->current = arena->first;
 }
 
 // ================================================================================
 // PARSING LOGIC
 // ================================================================================
 
+// --- Delimiter scanning ---
+// Inside an argument, the tokenizer only needs to stop at bytes that can change
+// its state: whitespace, quotes, backslash, '$', operator characters (| & ; ( ) >)
+// and the terminating NUL. These helpers
+// return how many ordinary bytes come before the next such byte, so long runs
+// (generated paths, big argument lists) are skipped 16 or 32 bytes per step.
+// Every byte <= 0x20 counts as special: that covers NUL and all whitespace, and
+// stopping early on other control characters is harmless (the per-byte loop
+// then treats them as ordinary).
+//
+// The vector versions use ALIGNED loads: an aligned block never crosses a page
+// boundary, so reading past the NUL (which always stops the scan) cannot fault.
+// That over-read is invisible to AddressSanitizer's model, hence no_sanitize.
+
+// Characters that start an operator token when unquoted
+int is_operator_char(char c) {
+  return c == '|' || c == '&' || c == ';' || c == '(' || c == ')' || c == '<' || c == '>';
+}
+
+size_t scan_ordinary_scalar(const char *p) {
+  const char *q = p;
+  while ((unsigned char)*q > 0x20 && *q != '\'' && *q != '"' && *q != '\\' && *q != '$' && !is_operator_char(*q)) {
+    q++;
+  }
+  return q - p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static inline unsigned special_mask_sse2(__m128i x) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(x, space), space); // x <= 0x20 (unsigned)
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('$')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('|')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('&')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(';')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('(')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(')')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('<')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('>')));
+  return (unsigned)_mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2"), no_sanitize_address))
+size_t scan_ordinary_sse2(const char *p) {
+  uintptr_t misalign = (uintptr_t)p & 15;
+  const __m128i *block = (const __m128i *)(p - misalign);
+  // Ignore the bytes of the first block that come before p
+  unsigned mask = special_mask_sse2(_mm_load_si128(block)) & (0xFFFFu << misalign);
+  while (mask == 0) {
+    block++;
+    mask = special_mask_sse2(_mm_load_si128(block));
+  }
+  return (const char *)block + __builtin_ctz(mask) - p;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned special_mask_avx2(__m256i x) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(x, space), space); // x <= 0x20 (unsigned)
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('$')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('|')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('&')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(';')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('(')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(')')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('<')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('>')));
+  return (unsigned)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+size_t scan_ordinary_avx2(const char *p) {
+  uintptr_t misalign = (uintptr_t)p & 31;
+  const __m256i *block = (const __m256i *)(p - misalign);
+  unsigned mask = special_mask_avx2(_mm256_load_si256(block)) & (0xFFFFFFFFu << misalign);
+  while (mask == 0) {
+    block++;
+    mask = special_mask_avx2(_mm256_load_si256(block));
+  }
+  return (const char *)block + __builtin_ctz(mask) - p;
+}
+
+#endif
+
+// Chosen once at startup by select_token_scanner()
+size_t (*scan_ordinary)(const char *p) = scan_ordinary_scalar;
+
+void select_token_scanner() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_ordinary = scan_ordinary_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    scan_ordinary = scan_ordinary_sse2;
+  }
+#endif
+}
+
+/*
+ * Classifies the operator starting at 'p' (longest match: "||" before "|",
+ * "&>" before "&"). Returns its length in bytes.
+ */
+int scan_operator(const char *p, struct token *op) {
+  *op = (struct token){TOKEN_WORD, NULL, 0, -1, 0};
+  switch (p[0]) {
+    case '|':
+      op->kind = p[1] == '|' ? TOKEN_OR_IF : TOKEN_PIPE;
+      return p[1] == '|' ? 2 : 1;
+    case '&':
+      if (p[1] == '>') {
+        op->kind = TOKEN_REDIRECT;
+        op->redirect = p[2] == '>' ? REDIRECT_BOTH_APPEND : REDIRECT_BOTH;
+        return p[2] == '>' ? 3 : 2;
+      }
+      op->kind = p[1] == '&' ? TOKEN_AND_IF : TOKEN_AMP;
+      return p[1] == '&' ? 2 : 1;
+    case ';':
+      op->kind = TOKEN_SEMI;
+      return 1;
+    case '(':
+      op->kind = TOKEN_LPAREN;
+      return 1;
+    case ')':
+      op->kind = TOKEN_RPAREN;
+      return 1;
+    case '<':
+      op->kind = TOKEN_REDIRECT;
+      if (p[1] == '<') {
+        if (p[2] == '<' || p[2] == '-') {
+          op->redirect = p[2] == '<' ? REDIRECT_HERESTRING : REDIRECT_HEREDOC_TABS;
+          return 3;
+        }
+        op->redirect = REDIRECT_HEREDOC;
+        return 2;
+      }
+      op->redirect = p[1] == '&' ? REDIRECT_DUP_INPUT : REDIRECT_INPUT;
+      return p[1] == '&' ? 2 : 1;
+    default: // '>'
+      op->kind = TOKEN_REDIRECT;
+      if (p[1] == '>' || p[1] == '&') {
+        op->redirect = p[1] == '>' ? REDIRECT_APPEND : REDIRECT_DUP_OUTPUT;
+        return 2;
+      }
+      op->redirect = REDIRECT_OUTPUT;
+      return 1;
+  }
+}
+
+// Appends an (uninitialized) token, growing the list geometrically. Exits on OOM.
+struct token *token_list_push(struct token_list *list) {
+  if (list->count == list->capacity) {
+    int capacity = list->capacity ? list->capacity * 2 : 64;
+    struct token *items = realloc(list->items, capacity * sizeof(struct token));
+    if (!items) {
+      perror("realloc");
+      exit(1);
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+  return &list->items[list->count++];
+}
+
+/*
+ * Manual tokenizer that splits a line into words and operators.
+ * Handles:
+ * - Single quotes ('foo bar' is one arg)
+ * - Double quotes ("foo bar" is one arg)
+ * - Backslash escaping (\)
+ * - Operators: | || & && ; ( ) and the redirections < > >> <& >& &> &>> << <<-
+ *   <<<, with or without spaces around them.
+ *   Quoted or escaped operator characters are ordinary ("echo '|'" prints |).
+ * - IO numbers: digits glued to a redirection ("2>file", "2>&1") become its fd.
+ * - '$' expansions outside single quotes: the '$' becomes EXPAND_MARK, and
+ *   expand_word() does the rest when the command runs.
+ *
+ * Zero-copy: words point INTO 'line', which is modified in place.
+ * Each word is NUL-terminated where its delimiter was. Removing quotes and
+ * escapes only ever shrinks a word, so its unquoted form is written back over
+ * itself (write position <= read position); plain words are never rewritten.
+ * An operator right after a word may have its first byte overwritten by that
+ * NUL, so it is classified before the word is terminated.
+ * There is no length limit on a single argument.
+ * Returns the number of tokens stored in 'tokens' (which is cleared first).
+ */
+int tokenize_line(char *line, struct token_list *tokens) {
+  int in_single_quote = 0;
+  int in_double_quote = 0;
+  int quoted = 0;     // The current word contains a quote or escape
+  char *token = NULL; // Start of the current word (NULL between tokens)
+  char *out = NULL;   // Where the current word's next character goes
+  tokens->count = 0;
+
+  for (char *p = line;; p++) {
+    char c = *p;
+
+    if (token == NULL) {
+      if (c == '\0') break; // End of line
+      if (isspace((unsigned char)c)) continue; // Skip delimiters between tokens
+
+      // An unquoted '#' at the start of a word begins a comment (ends the line)
+      if (c == '#') break;
+
+      if (is_operator_char(c)) {
+        struct token op;
+        p += scan_operator(p, &op) - 1;
+        *token_list_push(tokens) = op;
+        continue;
+      }
+
+      token = out = p; // A new word starts here
+      quoted = 0;
+    }
+
+    // Bulk-skip ordinary bytes (moving them down if quotes/escapes shifted the word)
+    size_t run = scan_ordinary(p);
+    if (run > 0) {
+      if (out != p) {
+        memmove(out, p, run);
+      }
+      out += run;
+      p += run;
+      c = *p;
+    }
+
+    // Toggle single quote state (unless inside double quotes)
+    if (!in_double_quote && c == '\'') {
+      in_single_quote = !in_single_quote;
+      quoted = 1;
+      continue; // Skip adding the quote char itself to the word
+    }
+
+    // Toggle double quote state (unless inside single quotes)
+    if (!in_single_quote && c == '"') {
+      in_double_quote = !in_double_quote;
+      quoted = 1;
+      continue;
+    }
+
+    // Check for the end of the word: NUL, or unquoted whitespace / operator
+    int unquoted = !in_single_quote && !in_double_quote;
+    if (c == '\0' || (unquoted && (isspace((unsigned char)c) || is_operator_char(c)))) {
+      struct token op;
+      int op_len = 0;
+      if (c != '\0' && !isspace((unsigned char)c)) {
+        op_len = scan_operator(p, &op); // Before the NUL below can overwrite *p
+      }
+
+      *out = '\0'; // Terminate the string in place (out <= p, so this never clobbers unread input)
+      size_t len = out - token;
+      if (op_len > 0 && op.kind == TOKEN_REDIRECT && op.redirect != REDIRECT_BOTH &&
+          op.redirect != REDIRECT_BOTH_APPEND && !quoted && len > 0 && len < 10 &&
+          strspn(token, "0123456789") == len) {
+        op.io_number = atoi(token); // "2>": the digits name the fd, they are not a word
+      } else if (len > 0) {
+        struct token *word = token_list_push(tokens);
+        *word = (struct token){TOKEN_WORD, token, quoted, -1, 0};
+      }
+      token = NULL;
+
+      if (c == '\0') break; // End of line
+      if (op_len > 0) {
+        *token_list_push(tokens) = op;
+        p += op_len - 1;
+      }
+      continue;
+    }
+
+    // "$?", "$NAME", "${...}": marked here, expanded when the command runs
+    if (c == '$' && !in_single_quote && (p[1] == '?' || p[1] == '{' || p[1] == '_' || isalpha((unsigned char)p[1]))) {
+      *out++ = EXPAND_MARK;
+      continue;
+    }
+
+    // Handle escapes inside double quotes (allows \", \\ and \$)
+    if (in_double_quote && c == '\\') {
+      char next = p[1];
+      if (next == '\0') continue; // Dangling backslash: the NUL ends the word next
+      p++;
+      if (next != '"' && next != '\\' && next != '$') {
+        // If not a special escape, keep the backslash literal
+        *out++ = '\\';
+      }
+      c = next;
+    }
+    // Handle escapes outside quotes (generic escaping)
+    else if (!in_single_quote && !in_double_quote && c == '\\') {
+      char next = p[1];
+      if (next == '\0') continue;
+      p++;
+      c = next;
+      quoted = 1;
+    }
+
+    // Append char to current word (only a real write once quotes/escapes shifted it)
+    if (out != p) {
+      *out = c;
+    }
+    out++;
+  }
+
+  return tokens->count;
+}
+
+// ================================================================================
+// COMMAND LIST PARSER (recursive descent)
+// ================================================================================
+// Grammar, one function per rule:
+//   list     := and_or ( ( ';' | '&' ) and_or )* [ ';' | '&' ]
+//   and_or   := pipeline ( ( '&&' | '||' ) pipeline )*
+//   pipeline := command ( '|' command )*
+//   command  := '(' list ')' redirect*
+//             | '{' list '}' redirect*
+//             | ( WORD | redirect )+
+//   redirect := [N]( '<' | '>' | '>>' ) WORD
+//             | [N]( '<&' | '>&' ) ( DIGITS | '-' )   duplicate / close fd N
+//             | ( '&>' | '&>>' | '>&' ) WORD           stdout and stderr to WORD
+//             | [N]( '<<' | '<<-' ) WORD              heredoc; WORD is the delimiter
+//             | [N]'<<<' WORD                         here-string
+// '{' and '}' are reserved words, not operators: they only count when unquoted,
+// written as a word of their own, in the position where a command starts.
+
+struct parser {
+  struct token *tokens;
+  int count;
+  int pos;
+  int failed; // A syntax error was reported; callers unwind with NULL
+};
+
+struct node *parse_list(struct parser *ps);
+
+struct token *parser_peek(struct parser *ps) {
+  return ps->pos < ps->count ? &ps->tokens[ps->pos] : NULL;
+}
+
+int parser_at(struct parser *ps, enum token_kind kind) {
+  struct token *tok = parser_peek(ps);
+  return tok != NULL && tok->kind == kind;
+}
+
+int parser_at_keyword(struct parser *ps, const char *keyword) {
+  struct token *tok = parser_peek(ps);
+  return tok != NULL && tok->kind == TOKEN_WORD && !tok->quoted && strcmp(tok->text, keyword) == 0;
+}
+
+// Reports the first syntax error only (inner rules fail first, outer ones follow)
+void parser_error(struct parser *ps) {
+  if (ps->failed) return;
+  ps->failed = 1;
+
+  static const char *names[] = {
+    [TOKEN_PIPE] = "|", [TOKEN_OR_IF] = "||", [TOKEN_AMP] = "&", [TOKEN_AND_IF] = "&&",
+    [TOKEN_SEMI] = ";", [TOKEN_LPAREN] = "(", [TOKEN_RPAREN] = ")",
+  };
+  static const char *redirect_names[] = {
+    [REDIRECT_OUTPUT] = ">", [REDIRECT_APPEND] = ">>", [REDIRECT_INPUT] = "<",
+    [REDIRECT_DUP_OUTPUT] = ">&", [REDIRECT_DUP_INPUT] = "<&",
+    [REDIRECT_BOTH] = "&>", [REDIRECT_BOTH_APPEND] = "&>>",
+    [REDIRECT_HEREDOC] = "<<", [REDIRECT_HEREDOC_TABS] = "<<-", [REDIRECT_HERESTRING] = "<<<",
+  };
+  struct token *tok = parser_peek(ps);
+  const char *text = "newline";
+  if (tok != NULL) {
+    if (tok->kind == TOKEN_WORD) text = tok->text;
+    else if (tok->kind == TOKEN_REDIRECT) text = redirect_names[tok->redirect];
+    else text = names[tok->kind];
+  }
+  fprintf(stderr, "shell: syntax error near unexpected token `%s'\n", text);
+}
+
+struct node *new_node(enum node_kind kind) {
+  struct node *node = arena_alloc(&line_arena, sizeof(struct node));
+  memset(node, 0, sizeof(*node));
+  node->kind = kind;
+  return node;
+}
+
+// Makes room in 'cmd' for the fd actions of 'count' redirections: at most two
+// each ("&>file" is an OPEN of stdout plus a DUP2 of stderr onto it)
+void command_reserve_redirects(struct command *cmd, int count) {
+  if (count > 0) {
+    cmd->redirects = arena_alloc(&line_arena, 2 * count * sizeof(struct fd_action));
+  }
+}
+
+/*
+ * Consumes one redirection (operator + target word), appending its fd actions
+ * to 'cmd'. Duplication targets must be fd numbers or '-' (close), except that
+ * ">&word" without an fd number is the old spelling of "&>word".
+ * Returns 0 on success.
+ */
+int parse_redirect(struct parser *ps, struct command *cmd) {
+  struct token *op = &ps->tokens[ps->pos++];
+  if (!parser_at(ps, TOKEN_WORD)) {
+    parser_error(ps);
+    return -1;
+  }
+  struct token *word = &ps->tokens[ps->pos++];
+  char *target = word->text;
+  struct fd_action *actions = cmd->redirects;
+  int fd = op->io_number;
+
+  switch (op->redirect) {
+    case REDIRECT_HEREDOC:
+    case REDIRECT_HEREDOC_TABS: {
+      // The body follows the command line; read_heredoc_bodies() fills in the text
+      struct fd_action *action = &actions[cmd->redirect_count++];
+      *action = (struct fd_action){.kind = FD_ACTION_DATA, .fd = fd < 0 ? STDIN_FILENO : fd, .src_fd = -1, .path = ""};
+      heredoc_push(action, target, op->redirect == REDIRECT_HEREDOC_TABS, !word->quoted);
+      return 0;
+    }
+    case REDIRECT_HERESTRING: {
+      size_t len = strlen(target);
+      char *text = arena_alloc(&line_arena, len + 2);
+      memcpy(text, target, len);
+      memcpy(text + len, "\n", 2); // Newline and terminator
+      actions[cmd->redirect_count++] = (struct fd_action){.kind = FD_ACTION_DATA, .fd = fd < 0 ? STDIN_FILENO : fd, .src_fd = -1, .path = text};
+      return 0;
+    }
+    case REDIRECT_INPUT:
+      actions[cmd->redirect_count++] = (struct fd_action){FD_ACTION_OPEN, fd < 0 ? STDIN_FILENO : fd, -1, target, O_RDONLY};
+      return 0;
+    case REDIRECT_OUTPUT:
+    case REDIRECT_APPEND:
+      actions[cmd->redirect_count++] = (struct fd_action){FD_ACTION_OPEN, fd < 0 ? STDOUT_FILENO : fd, -1, target,
+                                                         redirect_flags(op->redirect == REDIRECT_APPEND)};
+      return 0;
+    case REDIRECT_DUP_OUTPUT:
+    case REDIRECT_DUP_INPUT: {
+      if (fd < 0) fd = op->redirect == REDIRECT_DUP_INPUT ? STDIN_FILENO : STDOUT_FILENO;
+      size_t len = strlen(target);
+      if (strcmp(target, "-") == 0) {
+        actions[cmd->redirect_count++] = (struct fd_action){FD_ACTION_CLOSE, fd, -1, NULL, 0};
+        return 0;
+      }
+      if (len > 0 && len < 10 && strspn(target, "0123456789") == len) {
+        actions[cmd->redirect_count++] = (struct fd_action){FD_ACTION_DUP2, fd, atoi(target), NULL, 0};
+        return 0;
+      }
+      if (op->redirect == REDIRECT_DUP_INPUT || op->io_number >= 0) {
+        fprintf(stderr, "shell: %s: ambiguous redirect\n", target);
+        ps->failed = 1;
+        return -1;
+      }
+      break; // ">&file"
+    }
+    case REDIRECT_BOTH:
+    case REDIRECT_BOTH_APPEND:
+      break;
+  }
+
+  // Both stdout and stderr: the file once, then stderr onto the same open file
+  actions[cmd->redirect_count++] = (struct fd_action){FD_ACTION_OPEN, STDOUT_FILENO, -1, target,
+                                                     redirect_flags(op->redirect == REDIRECT_BOTH_APPEND)};
+  actions[cmd->redirect_count++] = (struct fd_action){FD_ACTION_DUP2, STDERR_FILENO, STDOUT_FILENO, NULL, 0};
+  return 0;
+}
+
+// Redirections written after a subshell or group: "( ... ) > file"
+int parse_redirect_suffix(struct parser *ps, struct command *cmd) {
+  int count = 0;
+  for (int i = ps->pos; i < ps->count && ps->tokens[i].kind == TOKEN_REDIRECT; i += 2) {
+    count++;
+  }
+  command_reserve_redirects(cmd, count);
+  while (parser_at(ps, TOKEN_REDIRECT)) {
+    if (parse_redirect(ps, cmd) < 0) return -1;
+  }
+  return 0;
+}
+
+struct node *parse_simple_command(struct parser *ps) {
+  // Count the words and redirections first so both arrays are allocated once
+  int word_count = 0;
+  int redirect_tokens = 0;
+  for (int i = ps->pos; i < ps->count; i++) {
+    if (ps->tokens[i].kind == TOKEN_REDIRECT) {
+      redirect_tokens++;
+      i++; // Skip the target
+    } else if (ps->tokens[i].kind == TOKEN_WORD) {
+      word_count++;
+    } else {
+      break;
+    }
+  }
+
+  struct node *node = new_node(NODE_COMMAND);
+  struct command *cmd = &node->cmd;
+  cmd->argv = arena_alloc(&line_arena, (word_count + 1) * sizeof(char *));
+  command_reserve_redirects(cmd, redirect_tokens);
+
+  int redirect_count = 0;
+  while (1) {
+    if (parser_at(ps, TOKEN_WORD)) {
+      cmd->argv[cmd->argc++] = ps->tokens[ps->pos++].text;
+    } else if (parser_at(ps, TOKEN_REDIRECT)) {
+      if (parse_redirect(ps, cmd) < 0) return NULL;
+      redirect_count++;
+    } else {
+      break;
+    }
+  }
+  cmd->argv[cmd->argc] = NULL;
+
+  if (cmd->argc == 0 && redirect_count == 0) {
+    parser_error(ps); // Not a command at all: an operator where one should start
+    return NULL;
+  }
+  return node;
+}
+
+struct node *parse_command_node(struct parser *ps) {
+  if (parser_at(ps, TOKEN_LPAREN) || parser_at_keyword(ps, "{")) {
+    int subshell = parser_at(ps, TOKEN_LPAREN);
+    ps->pos++;
+
+    struct node *node = new_node(subshell ? NODE_SUBSHELL : NODE_GROUP);
+    node->body = parse_list(ps);
+    if (node->body == NULL) return NULL;
+
+    if (subshell ? !parser_at(ps, TOKEN_RPAREN) : !parser_at_keyword(ps, "}")) {
+      parser_error(ps);
+      return NULL;
+    }
+    ps->pos++;
+
+    if (parse_redirect_suffix(ps, &node->cmd) < 0) return NULL;
+    return node;
+  }
+  return parse_simple_command(ps);
+}
+
+// 'time' with nothing after it is allowed ("time; ls"): it reports an empty run
+int parser_at_pipeline_end(struct parser *ps) {
+  struct token *tok = parser_peek(ps);
+  if (tok == NULL) return 1;
+  switch (tok->kind) {
+    case TOKEN_SEMI:
+    case TOKEN_AMP:
+    case TOKEN_AND_IF:
+    case TOKEN_OR_IF:
+    case TOKEN_RPAREN:
+      return 1;
+    default:
+      return parser_at_keyword(ps, "}");
+  }
+}
+
+struct node *parse_pipeline(struct parser *ps) {
+  if (parser_at_keyword(ps, "time")) {
+    // A keyword, not a command: it applies to the whole pipeline that follows
+    ps->pos++;
+    struct node *node = new_node(NODE_TIME);
+    if (parser_at_pipeline_end(ps)) return node;
+    node->body = parse_pipeline(ps);
+    return node->body != NULL ? node : NULL;
+  }
+
+  struct node *first = parse_command_node(ps);
+  if (first == NULL || !parser_at(ps, TOKEN_PIPE)) return first;
+
+  struct node *node = new_node(NODE_PIPELINE);
+  int capacity = 4;
+  node->stages = arena_alloc(&line_arena, capacity * sizeof(struct node *));
+  node->stages[node->stage_count++] = first;
+
+  while (parser_at(ps, TOKEN_PIPE)) {
+    ps->pos++;
+    struct node *stage = parse_command_node(ps);
+    if (stage == NULL) return NULL;
+
+    if (node->stage_count == capacity) {
+      // Grow geometrically; the old array simply stays in the arena until the line is done
+      struct node **stages = arena_alloc(&line_arena, 2 * capacity * sizeof(struct node *));
+      memcpy(stages, node->stages, capacity * sizeof(struct node *));
+      node->stages = stages;
+      capacity *= 2;
+    }
+    node->stages[node->stage_count++] = stage;
+  }
+  return node;
+}
+
+struct node *parse_and_or(struct parser *ps) {
+  struct node *left = parse_pipeline(ps);
+  while (left != NULL && (parser_at(ps, TOKEN_AND_IF) || parser_at(ps, TOKEN_OR_IF))) {
+    struct node *node = new_node(parser_at(ps, TOKEN_AND_IF) ? NODE_AND : NODE_OR);
+    ps->pos++;
+    node->left = left;
+    node->right = parse_pipeline(ps);
+    if (node->right == NULL) return NULL;
+    left = node;
+  }
+  return left;
+}
+
+// A list ends at the end of the line, or at the ')' / '}' closing its subshell/group
+int parser_at_list_end(struct parser *ps) {
+  return ps->pos == ps->count || parser_at(ps, TOKEN_RPAREN) || parser_at_keyword(ps, "}");
+}
+
+struct node *parse_list(struct parser *ps) {
+  struct node *list = NULL;
+  while (1) {
+    struct node *item = parse_and_or(ps);
+    if (item == NULL) return NULL;
+    if (parser_at(ps, TOKEN_AMP)) {
+      struct node *background = new_node(NODE_BACKGROUND);
+      background->body = item;
+      item = background;
+    }
+
+    if (list == NULL) {
+      list = item;
+    } else {
+      struct node *node = new_node(NODE_SEQUENCE);
+      node->left = list;
+      node->right = item;
+      list = node;
+    }
+
+    if (!parser_at(ps, TOKEN_SEMI) && !parser_at(ps, TOKEN_AMP)) break;
+    ps->pos++;
+    if (parser_at_list_end(ps)) break; // Trailing ';' or '&' ("{ echo a; }", "sleep 5 &")
+  }
+  return list;
+}
+
+/*
+ * Builds the syntax tree for one line's tokens.
+ * Returns NULL (after printing a message) if the line is not valid syntax.
+ */
+struct node *parse_line(struct token *tokens, int count) {
+  struct parser ps = {tokens, count, 0, 0};
+  struct node *root = parse_list(&ps);
+  if (root != NULL && ps.pos < ps.count) {
+    parser_error(&ps); // Something the grammar cannot continue with, e.g. a stray ')'
+    root = NULL;
+  }
+  if (root == NULL) {
+    // Heredocs after the error still have their bodies after the line: skip those too
+    for (int i = ps.pos; i + 1 < count; i++) {
+      struct token *tok = &tokens[i];
+      if (tok->kind == TOKEN_REDIRECT && tokens[i + 1].kind == TOKEN_WORD &&
+          (tok->redirect == REDIRECT_HEREDOC || tok->redirect == REDIRECT_HEREDOC_TABS)) {
+        struct fd_action *unused = arena_alloc(&line_arena, sizeof(struct fd_action));
+        heredoc_push(unused, tokens[i + 1].text, tok->redirect == REDIRECT_HEREDOC_TABS, 0);
+      }
+    }
+  }
+  return root;
+}
+
+// ================================================================================
+// RAW INPUT HANDLER
+// ================================================================================
+
+/*
+ * Finds the longest common prefix among a list of strings.
+ * Returns a newly allocated string that must be freed by the caller.
+ * 
+ * Logic:
+ * 1. Start with the first string as the candidate prefix.
+ * 2. Iterate through the rest of the strings.
+ * 3. For each string, shorten the candidate prefix until it matches the start of the string.
+ */
+char *find_lcp(char **matches, int count) {
+    if (count == 0) return NULL;
+    if (count == 1) return strdup(matches[0]);
+    
+    char *prefix = strdup(matches[0]);
+    int len = strlen(prefix);
+    
+    for (int i = 1; i < count; i++) {
+        int j = 0;
+        // Compare characters until mismatch or end of string
+        while (j < len && matches[i][j] != '\0' && prefix[j] == matches[i][j]) {
+            j++;
+        }
+        len = j; // Update length of common prefix
+        prefix[len] = '\0'; // Terminate string at new length
+    }
+    return prefix;
+}
+
+// ================================================================================
+// LINE EDITOR I/O BUFFERS
+// ================================================================================
+// Input: stdin is read in large chunks into a ring buffer, and the key-handling
+// code consumes bytes from it. Runs of ordinary characters are taken in bulk, so
+// a script piped into the shell costs a read() per 64 KiB, not per byte.
+// Output: everything the line editor echoes (typed characters, completions, erase
+// sequences) is collected in 'editor_out' and written with ONE write() per input
+// batch, instead of a printf + fflush per keystroke.
+
+struct editor_output {
+  char data[4096];
+  size_t len;
+};
+
+struct editor_output editor_out;
+
+// Bytes received but not processed yet. A paste or a script chunk can contain
+// many lines; whatever follows the Enter is kept for the next call.
+// 'head' and 'tail' only ever grow; masking with (size - 1) gives the position.
+struct input_ring {
+  char data[INPUT_RING_SIZE];
+  size_t head; // Next byte to consume
+  size_t tail; // Next free slot to fill
+};
+
+struct input_ring input_ring;
+
+// A line of input of any length. Grows geometrically and is reused for every
+// line, so once it has seen the longest line no more allocation happens.
+struct line_buffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+struct line_buffer input_line; // Shared by the REPL and stream-read scripts
+
+/*
+ * Fills the free space of the ring with ONE readv() (two segments when the free
+ * space wraps around the end). Returns the byte count, 0 on EOF, -1 on error.
+ */
+ssize_t input_ring_fill(int fd) {
+  size_t used = input_ring.tail - input_ring.head;
+  size_t free_space = INPUT_RING_SIZE - used;
+  if (free_space == 0) return -1;
+
+  size_t start = input_ring.tail & (INPUT_RING_SIZE - 1);
+  size_t first = INPUT_RING_SIZE - start;
+  if (first > free_space) first = free_space;
+
+  struct iovec iov[2] = {
+    {input_ring.data + start, first},
+    {input_ring.data, free_space - first},
+  };
+  ssize_t n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+  if (n > 0) input_ring.tail += n;
+  return n;
+}
+
+// Pending bytes that are contiguous in memory, starting at the next unread one.
+size_t input_ring_contiguous(const char **out) {
+  size_t start = input_ring.head & (INPUT_RING_SIZE - 1);
+  size_t used = input_ring.tail - input_ring.head;
+  size_t run = INPUT_RING_SIZE - start;
+  *out = input_ring.data + start;
+  return used < run ? used : run;
+}
+
+void input_ring_consume(size_t n) {
+  input_ring.head += n;
+}
+
+// Makes room for 'extra' more bytes plus the NUL terminator. Exits on OOM.
+void line_buffer_reserve(struct line_buffer *line, size_t extra) {
+  size_t needed = line->len + extra + 1;
+  if (needed <= line->capacity) return;
+
+  size_t capacity = line->capacity ? line->capacity : LINE_BUFFER_MIN;
+  while (capacity < needed) capacity *= 2;
+  char *data = realloc(line->data, capacity);
+  if (!data) {
+    perror("realloc");
+    exit(1);
+  }
+  line->data = data;
+  line->capacity = capacity;
+}
+
+void line_buffer_append(struct line_buffer *line, const char *data, size_t n) {
+  line_buffer_reserve(line, n);
+  memcpy(line->data + line->len, data, n);
+  line->len += n;
+  line->data[line->len] = '\0';
+}
+
+void line_buffer_append_str(struct line_buffer *line, const char *str) {
+  line_buffer_append(line, str, strlen(str));
+}
+
+void editor_flush() {
+  size_t off = 0;
+  while (off < editor_out.len) {
+    ssize_t n = write(STDOUT_FILENO, editor_out.data + off, editor_out.len - off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break; // Nothing sensible to do if the terminal is gone
+    }
+    off += n;
+  }
+  editor_out.len = 0;
+}
+
+void editor_write(const char *data, size_t n) {
+  while (n > 0) {
+    if (editor_out.len == sizeof(editor_out.data)) {
+      editor_flush();
+    }
+    size_t room = sizeof(editor_out.data) - editor_out.len;
+    size_t chunk = n < room ? n : room;
+    memcpy(editor_out.data + editor_out.len, data, chunk);
+    editor_out.len += chunk;
+    data += chunk;
+    n -= chunk;
+  }
+}
+
+void editor_puts(const char *str) {
+  editor_write(str, strlen(str));
+}
+
+void editor_putc(char c) {
+  editor_write(&c, 1);
+}
+
+/* * Processes input to handle specialized keys (TAB, Backspace).
+ * Bytes come from the input ring (filled in large chunks), and everything echoed
+ * back is collected in 'editor_out', written once the batch has been handled.
+ * The line is collected in 'line' (any length; the buffer grows as needed).
+ * Returns 1 if command entered, 0 on EOF (Ctrl+D, or end of piped input).
+ */
+int read_input_line(struct line_buffer *line) {
+  int tab_count = 0; // Track consecutive tabs
+  line->len = 0;
+  line_buffer_reserve(line, 0);
+  line->data[0] = '\0';
+
+  while (1) {
+    const char *pending;
+    size_t avail = input_ring_contiguous(&pending);
+    if (avail == 0) {
+      // About to block for more input: show everything echoed for this batch first
+      editor_flush();
+
+      // Handle child exits and PATH changes until there is something to read
+      events_wait_for_input();
+
+      // In Raw Mode, read() returns as soon as anything is available: one key,
+      // or a whole paste at once. From a pipe or file we get a full chunk.
+      ssize_t n = input_ring_fill(STDIN_FILENO);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        if (line->len == 0) return 0; // End of input on an empty line, signal exit
+        break;
+      }
+      continue;
+    }
+
+    // Fast path: take the whole run of ordinary (non-control) characters at once.
+    size_t run = 0;
+    while (run < avail && (unsigned char)pending[run] >= 0x20 && pending[run] != 127) {
+      run++;
+    }
+    if (run > 0) {
+      line_buffer_append(line, pending, run);
+      editor_write(pending, run); // We must manually ECHO the characters back to the user
+      input_ring_consume(run);
+      tab_count = 0;
+      continue;
+    }
+
+    char c = pending[0];
+    input_ring_consume(1);
+
+    // Handle Ctrl+D (EOF - Value 4)
+    if (c == 4) { 
+        if (line->len == 0) {
+          editor_flush();
+          return 0; // If line is empty, signal exit
+        }
+        break; 
+    }
+    
+    // Handle Enter/Return (Carriage Return or Newline)
+    if (c == '\n' || c == '\r') {
+      editor_putc('\n'); // Move to new line visually for the user
+      editor_flush();
+      return 1;
+    }
+
+    // === TAB COMPLETION ===
+    if (c == '\t') {
+      // 1. Isolate the last word the user was typing
+      char *buffer = line->data;
+      size_t len = line->len;
+      size_t start = 0;
+      while (start < len && (buffer[start] == ' ' || buffer[start] == '\t')) {
+        start++;
+      }
+      
+      char prefix[128];
+      size_t i = 0;
+      while (start + i < len && !isspace((unsigned char)buffer[start + i]) && i < sizeof(prefix) - 1) {
+        prefix[i] = buffer[start + i];
+        i++;
+      }
+      prefix[i] = '\0';
+
+      char **matches = NULL;
+      int match_count = get_completions(prefix, &matches);
+
+      if (match_count == 0) {
+          editor_putc('\a'); // Bell sound
+          tab_count = 0;
+      } else if (match_count == 1) {
+          // Autocomplete
+          size_t prefix_len = strlen(prefix);
+          size_t comp_len = strlen(matches[0]);
+
+          editor_puts(matches[0] + prefix_len); // Visual update
+          editor_putc(' ');
+
+          // Buffer update
+          line_buffer_append(line, matches[0] + prefix_len, comp_len - prefix_len);
+          line_buffer_append(line, " ", 1);
+          tab_count = 0;
+      } else {
+          // Multiple matches found
+          // Calculate the Longest Common Prefix (LCP) of all matches
+          char *lcp = find_lcp(matches, match_count);
+          size_t prefix_len = strlen(prefix);
+          size_t lcp_len = strlen(lcp);
+
+          // If the LCP is longer than what the user has typed so far,
+          // we can auto-complete up to the LCP.
+          if (lcp_len > prefix_len) {
+              editor_puts(lcp + prefix_len); // Print only the new characters
+
+              // Append new characters to the buffer
+              line_buffer_append(line, lcp + prefix_len, lcp_len - prefix_len);
+              tab_count = 0; // Reset tab count so next tab triggers list
+          } else {
+              // If we can't extend the prefix (LCP == current input),
+              // behave like standard shell:
+              // 1st Tab: Bell
+              // 2nd Tab: List all matches
+              if (tab_count == 0) {
+                  editor_putc('\a'); // Bell sound
+                  tab_count = 1;
+              } else {
+                  editor_putc('\n');
+                  for (int j = 0; j < match_count; j++) {
+                      editor_puts(matches[j]);
+                      editor_puts("  ");
+                  }
+                  editor_putc('\n');
+                  editor_puts("$ "); // Reprint prompt and buffer
+                  editor_write(line->data, line->len);
+                  tab_count = 0;
+              }
+          }
+          free(lcp);
+      }
+
+      continue;
+    }
+
+    // Reset tab count for any other key
+    tab_count = 0;
+
+    // === BACKSPACE HANDLING ===
+    // 127 is Standard DEL, \b is used in some terminals.
+    if (c == 127 || c == '\b') {
+      if (line->len > 0) {
+        line->len--;
+        line->data[line->len] = '\0';
+        // Visual erase trick: Move cursor back (\b), print Space ( ), move cursor back again (\b)
+        editor_puts("\b \b");
+      }
+      continue;
+    }
+
+    // Ordinary characters were taken by the fast path above;
+    // ignore other weird control characters
+  }
+  editor_flush();
+  return 1;
+}
+
+// Converts a waitpid() status to a shell exit status: the exit code, or 128 + signal
+int decode_wait_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// ================================================================================
+// RESOURCE ACCOUNTING
+// ================================================================================
+// Children are reaped with wait4(), which also returns what the child used (its
+// own CPU time plus that of its reaped descendants, and its peak RSS). Every
+// exit is added to 'child_usage': 'times' prints the totals, and 'time' prints
+// the difference a pipeline made, plus the shell's own time for builtins.
+
+double timeval_seconds(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Bash's format: "1m2.345s"
+void format_duration(char *buf, size_t size, double seconds) {
+  int minutes = (int)(seconds / 60);
+  snprintf(buf, size, "%dm%.3fs", minutes, seconds - minutes * 60);
+}
+
+// Adds one reaped child's usage to the session totals
+void account_child(const struct rusage *usage) {
+  timeradd(&child_usage.ru_utime, &usage->ru_utime, &child_usage.ru_utime);
+  timeradd(&child_usage.ru_stime, &usage->ru_stime, &child_usage.ru_stime);
+  if (usage->ru_maxrss > child_usage.ru_maxrss) child_usage.ru_maxrss = usage->ru_maxrss;
+  if (usage->ru_maxrss > child_maxrss_peak) child_maxrss_peak = usage->ru_maxrss;
+}
+
+/*
+ * time [pipeline]: runs it and reports to stderr its real time, the user/sys
+ * time of the shell and of every child reaped meanwhile, and the largest
+ * child's peak RSS (the shell's own if no child ran). Returns its status.
+ */
+int execute_timed(struct node *body) {
+  struct timespec start, end;
+  struct rusage self_before, self_after;
+  struct rusage children_before = child_usage;
+  long outer_peak = child_maxrss_peak;
+  child_maxrss_peak = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  getrusage(RUSAGE_SELF, &self_before);
+
+  int status = body != NULL ? execute_node(body) : 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &self_after);
+  double real = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double user = timeval_seconds(self_after.ru_utime) - timeval_seconds(self_before.ru_utime) +
+                timeval_seconds(child_usage.ru_utime) - timeval_seconds(children_before.ru_utime);
+  double sys = timeval_seconds(self_after.ru_stime) - timeval_seconds(self_before.ru_stime) +
+               timeval_seconds(child_usage.ru_stime) - timeval_seconds(children_before.ru_stime);
+  long maxrss = child_maxrss_peak ? child_maxrss_peak : self_after.ru_maxrss;
+  if (outer_peak > child_maxrss_peak) child_maxrss_peak = outer_peak; // An enclosing 'time' saw it too
+
+  char real_text[32], user_text[32], sys_text[32];
+  format_duration(real_text, sizeof(real_text), real);
+  format_duration(user_text, sizeof(user_text), user);
+  format_duration(sys_text, sizeof(sys_text), sys);
+  fflush(stdout);
+  fprintf(stderr, "\nreal\t%s\nuser\t%s\nsys\t%s\nmaxrss\t%ldk\n", real_text, user_text, sys_text, maxrss);
+  return status;
+}
+
+// ================================================================================
+// JOB CONTROL
+// ================================================================================
+// Every pipeline (or single external command, or subshell) the shell starts is a
+// job. In an interactive shell each job gets its own process group, and a
+// foreground job is also given the terminal, so Ctrl+C / Ctrl+Z reach the job
+// and not the shell. Stopped and background jobs are kept in 'job_table'.
+//
+// Children are reaped by PID, never with waitpid(-1), so no code path can steal
+// the status of a child another one is waiting for. Exits normally arrive through
+// the event loop (pidfds); job_reap() polls the table for anything left over.
+
+// Signals an interactive shell ignores and its children must get back
+void job_signal_set(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGQUIT);
+  sigaddset(set, SIGTSTP);
+  sigaddset(set, SIGTTIN);
+  sigaddset(set, SIGTTOU);
+}
+
+void init_job_control(int interactive) {
+  if (!interactive) return;
+
+  // Wait until we are in the foreground (started as "shell &" from another shell)
+  while (tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+    kill(-getpgrp(), SIGTTIN);
+  }
+
+  sigset_t ignored;
+  job_signal_set(&ignored);
+  for (int sig = 1; sig < NSIG; sig++) {
+    if (sigismember(&ignored, sig) == 1) signal(sig, SIG_IGN);
+  }
+
+  // Lead our own process group and own the terminal
+  shell_pgid = getpid();
+  setpgid(0, shell_pgid);
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  job_control = 1;
+}
+
+/*
+ * Runs in a freshly forked child (before its fd actions): joins the job's process
+ * group, takes the terminal if it leads a foreground job, and restores the
+ * signals the shell ignores. No-op without job control.
+ */
+void job_enter_group_in_child(struct job *job) {
+  if (job == NULL || !job_control) return;
+  pid_t pgid = job->pgid ? job->pgid : getpid();
+  setpgid(0, pgid);
+  if (job->foreground && job->pgid == 0) {
+    tcsetpgrp(STDIN_FILENO, pgid); // SIGTTOU is still ignored at this point
+  }
+
+  sigset_t defaults;
+  job_signal_set(&defaults);
+  for (int sig = 1; sig < NSIG; sig++) {
+    if (sigismember(&defaults, sig) == 1) signal(sig, SIG_DFL);
+  }
+}
+
+// --- Command text for 'jobs' ---
+
+void format_node(struct line_buffer *out, struct node *node);
+
+void format_command(struct line_buffer *out, struct command *cmd) {
+  for (int i = 0; i < cmd->argc; i++) {
+    if (i > 0) line_buffer_append_str(out, " ");
+    line_buffer_append_str(out, cmd->argv[i]);
+  }
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    struct fd_action *a = &cmd->redirects[i];
+    int input = a->kind == FD_ACTION_OPEN ? (a->flags & O_ACCMODE) == O_RDONLY : a->fd == STDIN_FILENO;
+    if (a->kind == FD_ACTION_DATA) input = 1;
+    char fd_text[16] = ""; // Left out when it is the operator's default
+    if (a->fd != (input ? STDIN_FILENO : STDOUT_FILENO)) {
+      snprintf(fd_text, sizeof(fd_text), "%d", a->fd);
+    }
+    char text[48];
+    if (a->kind == FD_ACTION_OPEN) {
+      snprintf(text, sizeof(text), " %s%s ", fd_text, input ? "<" : (a->flags & O_APPEND) ? ">>" : ">");
+    } else if (a->kind == FD_ACTION_DUP2) {
+      snprintf(text, sizeof(text), " %s%s&%d", fd_text, input ? "<" : ">", a->src_fd);
+    } else if (a->kind == FD_ACTION_DATA) {
+      snprintf(text, sizeof(text), " %s<<< ", fd_text); // A heredoc shows its first line
+    } else {
+      snprintf(text, sizeof(text), " %s%s&-", fd_text, input ? "<" : ">");
+    }
+    line_buffer_append_str(out, text);
+    if (a->kind == FD_ACTION_OPEN) line_buffer_append_str(out, a->path);
+    if (a->kind == FD_ACTION_DATA) line_buffer_append(out, a->path, strcspn(a->path, "\n"));
+  }
+}
+
+void format_node(struct line_buffer *out, struct node *node) {
+  switch (node->kind) {
+    case NODE_COMMAND:
+      format_command(out, &node->cmd);
+      break;
+    case NODE_PIPELINE:
+      for (int i = 0; i < node->stage_count; i++) {
+        if (i > 0) line_buffer_append_str(out, " | ");
+        format_node(out, node->stages[i]);
+      }
+      break;
+    case NODE_AND:
+    case NODE_OR:
+    case NODE_SEQUENCE:
+      format_node(out, node->left);
+      line_buffer_append_str(out, node->kind == NODE_AND ? " && " : node->kind == NODE_OR ? " || " : "; ");
+      format_node(out, node->right);
+      break;
+    case NODE_BACKGROUND:
+      format_node(out, node->body);
+      line_buffer_append_str(out, " &");
+      break;
+    case NODE_TIME:
+      line_buffer_append_str(out, "time");
+      if (node->body != NULL) {
+        line_buffer_append_str(out, " ");
+        format_node(out, node->body);
+      }
+      break;
+    case NODE_SUBSHELL:
+    case NODE_GROUP:
+      line_buffer_append_str(out, node->kind == NODE_SUBSHELL ? "(" : "{ ");
+      format_node(out, node->body);
+      line_buffer_append_str(out, node->kind == NODE_SUBSHELL ? ")" : "; }");
+      format_command(out, &node->cmd); // Only its redirections
+      break;
+  }
+}
+
+// --- Job table ---
+
+/*
+ * Prepares a job for 'stage_count' processes (slot i = pipeline stage i).
+ * The PID array lives in 'line_arena'; job_add() copies it if the job outlives the line.
+ */
+void job_init(struct job *job, struct node **stages, int stage_count, int foreground) {
+  memset(job, 0, sizeof(*job));
+  job->pids = arena_alloc(&line_arena, stage_count * sizeof(pid_t));
+  memset(job->pids, 0, stage_count * sizeof(pid_t));
+  job->pidfds = arena_alloc(&line_arena, stage_count * sizeof(int));
+  job->statuses = arena_alloc(&line_arena, stage_count * sizeof(int));
+  memset(job->statuses, 0, stage_count * sizeof(int));
+  for (int i = 0; i < stage_count; i++) {
+    job->pidfds[i] = -1;
+  }
+  job->pid_count = stage_count;
+  job->state = JOB_RUNNING;
+  job->foreground = foreground;
+  job->stages = stages;
+  job->stage_count = stage_count;
+}
+
+// Records the process started for stage 'index'
+void job_add_process(struct job *job, int index, pid_t pid) {
+  job->pids[index] = pid;
+  job->pidfds[index] = events_watch_child(pid);
+  job->live_count++;
+  if (!job_control) return;
+
+  // The child does the same; doing it here too closes the race either way
+  int leader = job->pgid == 0;
+  if (leader) job->pgid = pid;
+  setpgid(pid, job->pgid);
+  if (leader && job->foreground) {
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+  }
+}
+
+// Copies a job into the table (growing it as needed). Returns the table's copy.
+struct job *job_add(struct job *job) {
+  int slot = 0;
+  while (slot < job_table_size && job_table[slot] != NULL) slot++;
+  if (slot == job_table_size) {
+    int size = job_table_size ? job_table_size * 2 : 8;
+    struct job **table = realloc(job_table, size * sizeof(struct job *));
+    if (!table) {
+      perror("realloc");
+      exit(1);
+    }
+    memset(table + job_table_size, 0, (size - job_table_size) * sizeof(struct job *));
+    job_table = table;
+    job_table_size = size;
+  }
+
+  struct job *copy = malloc(sizeof(struct job));
+  pid_t *pids = malloc(job->pid_count * sizeof(pid_t));
+  int *pidfds = malloc(job->pid_count * sizeof(int));
+  int *statuses = malloc(job->pid_count * sizeof(int));
+  if (!copy || !pids || !pidfds || !statuses) {
+    perror("malloc");
+    exit(1);
+  }
+  *copy = *job;
+  memcpy(pids, job->pids, job->pid_count * sizeof(pid_t));
+  memcpy(pidfds, job->pidfds, job->pid_count * sizeof(int));
+  copy->pids = pids;
+  memcpy(statuses, job->statuses, job->pid_count * sizeof(int));
+  copy->pidfds = pidfds;
+  copy->statuses = statuses;
+  copy->id = slot + 1;
+  copy->sequence = ++job_sequence;
+
+  // Render the text now: the syntax tree goes away with the line
+  struct line_buffer text = {0};
+  line_buffer_reserve(&text, 0);
+  text.data[0] = '\0';
+  for (int i = 0; i < job->stage_count; i++) {
+    if (i > 0) line_buffer_append_str(&text, " | ");
+    format_node(&text, job->stages[i]);
+  }
+  copy->command = text.data;
+  copy->stages = NULL;
+
+  job_table[slot] = copy;
+  return copy;
+}
+
+void job_remove(struct job *job) {
+  job_table[job->id - 1] = NULL;
+  for (int i = 0; i < job->pid_count; i++) {
+    if (job->pidfds[i] >= 0) close(job->pidfds[i]);
+  }
+  free(job->pids);
+  free(job->pidfds);
+  free(job->statuses);
+  free(job->command);
+  free(job);
+}
+
+/*
+ * Updates the job with one wait4() result for the process of stage 'index'.
+ * 'usage' (NULL if unknown) is accounted once the process has exited.
+ */
+void job_record_status(struct job *job, int index, int status, const struct rusage *usage) {
+  if (WIFSTOPPED(status)) {
+    // Every stage reports its own stop; the job was stopped by the first one
+    if (job->state != JOB_STOPPED) {
+      job->state = JOB_STOPPED;
+      job->sequence = ++job_sequence;
+      job->notify = 1;
+    }
+    return;
+  }
+  if (WIFCONTINUED(status)) {
+    job->state = JOB_RUNNING;
+    return;
+  }
+
+  job->pids[index] = -job->pids[index]; // Reaped (kept negated for 'wait PID')
+  job->live_count--;
+  if (usage != NULL) account_child(usage);
+  if (job->pidfds[index] >= 0) {
+    close(job->pidfds[index]); // Also drops it from the epoll set
+    job->pidfds[index] = -1;
+  }
+  job->statuses[index] = decode_wait_status(status);
+  if (index == job->pid_count - 1) {
+    job->last_status = job->statuses[index];
+  }
+  if (job->live_count == 0) {
+    job->state = JOB_DONE;
+    job->notify = 1;
+  }
+}
+
+// The process is gone without a status we could collect (ECHILD)
+void job_forget_process(struct job *job, int index) {
+  job->pids[index] = -job->pids[index];
+  job->live_count--;
+  if (job->pidfds[index] >= 0) {
+    close(job->pidfds[index]);
+    job->pidfds[index] = -1;
+  }
+  if (job->live_count == 0) job->state = JOB_DONE;
+}
+
+// Collects every pending state change (exit, stop, continue) of one job, without blocking
+void job_poll(struct job *job) {
+  for (int i = 0; i < job->pid_count; i++) {
+    int status;
+    struct rusage usage;
+    pid_t r;
+    while (job->pids[i] > 0 && (r = wait4(job->pids[i], &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) != 0) {
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        job_forget_process(job, i);
+        break;
+      }
+      job_record_status(job, i, status, &usage);
+    }
+  }
+}
+
+// Same for every job in the table
+void job_reap() {
+  for (int j = 0; j < job_table_size; j++) {
+    if (job_table[j] != NULL) job_poll(job_table[j]);
+  }
+}
+
+// Finds the live process 'pid' in the foreground job or the table
+struct job *job_by_pid(pid_t pid, int *index) {
+  for (int j = -1; j < job_table_size; j++) {
+    struct job *job = j < 0 ? foreground_job : job_table[j];
+    if (job == NULL) continue;
+    for (int i = 0; i < job->pid_count; i++) {
+      if (job->pids[i] == pid) {
+        *index = i;
+        return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+// The current job (+) is the most recently started or stopped one; 'previous' gives the one before (-)
+struct job *job_current(int previous) {
+  struct job *best = NULL;
+  struct job *second = NULL;
+  for (int j = 0; j < job_table_size; j++) {
+    struct job *job = job_table[j];
+    if (job == NULL) continue;
+    if (best == NULL || job->sequence > best->sequence) {
+      second = best;
+      best = job;
+    } else if (second == NULL || job->sequence > second->sequence) {
+      second = job;
+    }
+  }
+  return previous ? second : best;
+}
+
+void job_print(struct job *job) {
+  char state[32];
+  if (job->state == JOB_RUNNING) {
+    snprintf(state, sizeof(state), "Running");
+  } else if (job->state == JOB_STOPPED) {
+    snprintf(state, sizeof(state), "Stopped");
+  } else if (job->last_status == 0) {
+    snprintf(state, sizeof(state), "Done");
+  } else {
+    snprintf(state, sizeof(state), "Exit %d", job->last_status);
+  }
+
+  char marker = job == job_current(0) ? '+' : job == job_current(1) ? '-' : ' ';
+  out_printf("[%d]%c  %-24s%s%s\n", job->id, marker, state, job->command,
+         job->state == JOB_RUNNING ? " &" : "");
+}
+
+/*
+ * Tells the user about jobs that stopped or finished since the last prompt
+ * (interactive shells only) and forgets the finished ones.
+ */
+void job_notify() {
+  for (int j = 0; j < job_table_size; j++) {
+    struct job *job = job_table[j];
+    if (job == NULL || !job->notify) continue;
+    if (job_control) job_print(job);
+    job->notify = 0;
+    if (job->state == JOB_DONE) job_remove(job);
+  }
+  out_flush();
+}
+
+/*
+ * Resolves a job spec: NULL, "%%" or "%+" (current job), "%-" (previous job),
+ * "%N" or "N" (job number N). Prints an error to 'err_fd' and returns NULL if there is none.
+ */
+struct job *job_find(const char *builtin_name, const char *spec, int err_fd) {
+  struct job *job = NULL;
+  if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+    job = job_current(0);
+  } else if (strcmp(spec, "%-") == 0) {
+    job = job_current(1);
+  } else {
+    const char *digits = spec[0] == '%' ? spec + 1 : spec;
+    char *end;
+    long id = strtol(digits, &end, 10);
+    if (*digits != '\0' && *end == '\0' && id >= 1 && id <= job_table_size) {
+      job = job_table[id - 1];
+    }
+  }
+
+  if (job == NULL) {
+    dprintf(err_fd, "%s: %s: no such job\n", builtin_name, spec ? spec : "current");
+  }
+  return job;
+}
+
+/*
+ * Blocks until no process of the job is left (or, with 'stop_ends_wait', until
+ * it is stopped, or until Ctrl+C sets 'interrupted'). Children with a pidfd are
+ * awaited through the event loop, which handles everything else that happens
+ * meanwhile; the others get a plain blocking wait4().
+ */
+void job_wait(struct job *job, int stop_ends_wait) {
+  int flags = stop_ends_wait && job_control ? WUNTRACED : 0;
+  for (int i = 0; i < job->pid_count; i++) {
+    while (job->pids[i] > 0 && job->pidfds[i] < 0 && !(stop_ends_wait && job->state == JOB_STOPPED)) {
+      int status;
+      struct rusage usage;
+      if (wait4(job->pids[i], &status, flags, &usage) < 0) {
+        if (errno == EINTR) continue;
+        job_forget_process(job, i);
+        break;
+      }
+      job_record_status(job, i, status, &usage);
+    }
+  }
+  while (job->live_count > 0 && !(stop_ends_wait && job->state == JOB_STOPPED) && !interrupted) {
+    events_wait(-1);
+  }
+}
+
+// Blocks until every process of the job has exited. Returns the job's status.
+int job_wait_blocking(struct job *job) {
+  job_wait(job, 0);
+  return job->last_status;
+}
+
+// --- Foreground jobs and the terminal ---
+
+// Hands the terminal to a foreground job: normal (cooked) line mode, or the
+// modes it had when it was stopped, and its process group in the foreground.
+void terminal_give_to_job(struct job *job) {
+  if (!job_control) return;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, job->has_tmodes ? &job->tmodes : &original_termios);
+  if (job->pgid > 0) {
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+  }
+}
+
+// Takes the terminal back for the line editor (raw mode, shell in the foreground)
+void terminal_take_back(struct job *job) {
+  if (!job_control) return;
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  if (job->state == JOB_STOPPED) {
+    // An editor stopped with Ctrl+Z gets its own modes back with 'fg'
+    tcgetattr(STDIN_FILENO, &job->tmodes);
+    job->has_tmodes = 1;
+  }
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios);
+}
+
+/*
+ * Waits until a foreground job finishes or is stopped, then gives the terminal
+ * back to the shell. A stopped job is moved to the job table.
+ * Returns the job's exit status (128 + SIGTSTP if it was stopped).
+ */
+int wait_for_job(struct job *job) {
+  // A job from the table (fg) is found there; a new one is only known through this
+  struct job *outer = foreground_job;
+  if (job->id == 0) foreground_job = job;
+  job_wait(job, 1);
+  foreground_job = outer;
+  terminal_take_back(job);
+
+  if (job->state == JOB_STOPPED) {
+    struct job *stopped = job->id ? job : job_add(job);
+    stopped->notify = 0;
+    printf("\n");
+    job_print(stopped);
+    out_flush();
+    return 128 + SIGTSTP;
+  }
+  if (job_control && job->last_status == 128 + SIGINT) {
+    printf("\n"); // Ctrl+C: the prompt goes on a fresh line, after the echoed ^C
+  }
+  return job->last_status;
+}
+
+// ================================================================================
+// EVENT LOOP (epoll over pidfds, SIGCHLD, inotify and the terminal)
+// ================================================================================
+// One epoll instance watches everything the shell can be waiting for:
+// - a pidfd per child: readable once that child has exited, so it is reaped
+//   right away with wait4(pid, WNOHANG), whichever job it belongs to;
+// - a signalfd for SIGCHLD (blocked, so no handler runs): only needed for stops
+//   and continues, which pidfds do not report;
+// - the inotify fd of the PATH index;
+// - stdin, only while the line editor waits for a key (one-shot, re-armed by
+//   each wait): typed-ahead input must not wake a foreground wait over and over.
+// So a foreground wait also reaps finished background jobs, and waiting for input
+// keeps the PATH index current. Without pidfd support (kernel < 5.3) children are
+// waited for with plain blocking wait4() instead.
+
+// Other tags are a child's PID, with its pidfd in the upper 32 bits
+enum { EVENT_STDIN = -1, EVENT_INOTIFY = -2, EVENT_SIGCHLD = -3, EVENT_SIGINT = -4 };
+
+int event_fd = -1;     // epoll instance (-1: not available, use blocking waits)
+int signal_fd = -1;    // SIGCHLD as a readable fd
+int interrupt_fd = -1; // SIGINT as a readable fd, while a wait may be cut short
+int stdin_watched;     // The line editor's input is in the set (disarmed between waits)
+int pidfd_supported = 1;
+
+int events_add(int fd, long tag) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint64_t)tag;
+  return epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Sets what stdin reports: EPOLLIN | EPOLLONESHOT to arm it once, or nothing
+int events_set_stdin(int op, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.u64 = (uint64_t)EVENT_STDIN;
+  return epoll_ctl(event_fd, op, STDIN_FILENO, &ev);
+}
+
+/*
+ * Creates the epoll set (again in forked subshells: an epoll instance is shared
+ * across fork(), so a child must never touch its parent's). SIGCHLD stays blocked
+ * from here on; children get an empty signal mask back when they are spawned.
+ */
+void events_init(int watch_stdin) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+
+  event_fd = fd_make_private(epoll_create1(EPOLL_CLOEXEC));
+  if (event_fd < 0) return;
+  signal_fd = fd_make_private(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+  if (signal_fd >= 0) events_add(signal_fd, EVENT_SIGCHLD);
+  if (inotify_fd >= 0) events_add(inotify_fd, EVENT_INOTIFY);
+  stdin_watched = watch_stdin && events_set_stdin(EPOLL_CTL_ADD, 0) == 0;
+}
+
+/*
+ * Opens a pidfd for a child just started and adds it to the set.
+ * Returns the pidfd, or -1 if the child must be waited for the blocking way.
+ */
+int events_watch_child(pid_t pid) {
+  if (event_fd < 0 || !pidfd_supported) return -1;
+#ifdef SYS_pidfd_open
+  int pidfd = syscall(SYS_pidfd_open, pid, 0); // Close-on-exec by default
+#else
+  int pidfd = -1;
+  errno = ENOSYS;
+#endif
+  if (pidfd < 0) {
+    if (errno == ENOSYS) pidfd_supported = 0; // Old kernel: don't ask again
+    return -1;
+  }
+  pidfd = fd_make_private(pidfd);
+  if (events_add(pidfd, (long)pidfd << 32 | pid) < 0) {
+    close(pidfd);
+    return -1;
+  }
+  return pidfd;
+}
+
+/*
+ * Lets Ctrl+C end the waits that follow ('on'), for the 'wait' builtin: the shell
+ * ignores SIGINT, but a blocked one is still queued and shows up on a signalfd.
+ * Turning it off again clears 'interrupted'. Interactive shells only.
+ */
+void events_catch_interrupt(int on) {
+  if (!job_control || event_fd < 0) return;
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  interrupted = 0;
+  if (on) {
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    interrupt_fd = fd_make_private(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+    if (interrupt_fd >= 0) events_add(interrupt_fd, EVENT_SIGINT);
+  } else {
+    if (interrupt_fd >= 0) close(interrupt_fd); // Also drops it from the epoll set
+    interrupt_fd = -1;
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+  }
+}
+
+// A pidfd became readable: reap that one child (a foreground or table job's)
+void events_child_exited(pid_t pid, int pidfd) {
+  int index;
+  struct job *job = job_by_pid(pid, &index);
+  if (job == NULL) {
+    // Whoever started it reaps it; left in the set, the pidfd would fire on every wait
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, pidfd, NULL);
+    return;
+  }
+
+  int status;
+  struct rusage usage;
+  pid_t r;
+  while ((r = wait4(pid, &status, WNOHANG, &usage)) < 0 && errno == EINTR) {}
+  if (r > 0) {
+    job_record_status(job, index, status, &usage);
+  } else if (r < 0) {
+    job_forget_process(job, index);
+  }
+}
+
+/*
+ * Waits for events (up to 'timeout_ms', -1 = forever) and handles them.
+ * Returns 1 if stdin is readable.
+ */
+int events_wait(int timeout_ms) {
+  struct epoll_event events[16];
+  int n = epoll_wait(event_fd, events, 16, timeout_ms);
+  int input_ready = 0;
+
+  for (int i = 0; i < n; i++) {
+    long tag = (long)events[i].data.u64;
+    if (tag == EVENT_STDIN) {
+      input_ready = 1;
+    } else if (tag == EVENT_INOTIFY) {
+      path_index_drain();
+    } else if (tag == EVENT_SIGCHLD) {
+      struct signalfd_siginfo info;
+      while (read(signal_fd, &info, sizeof(info)) > 0) {}
+      // Something stopped, continued or exited: poll the jobs' PIDs
+      if (foreground_job != NULL) job_poll(foreground_job);
+      job_reap();
+    } else if (tag == EVENT_SIGINT) {
+      struct signalfd_siginfo info;
+      while (read(interrupt_fd, &info, sizeof(info)) > 0) {}
+      interrupted = 1;
+    } else {
+      events_child_exited((pid_t)(tag & 0xffffffff), (int)(tag >> 32));
+    }
+  }
+  return input_ready;
+}
+
+// Called by the line editor before it blocks on stdin. Stdin disarms itself when it fires.
+void events_wait_for_input() {
+  if (event_fd < 0 || !stdin_watched) return;
+  events_set_stdin(EPOLL_CTL_MOD, EPOLLIN);
+  while (!events_wait(-1)) {}
+}
+
+// ================================================================================
+// PARALLEL EXECUTOR
+// ================================================================================
+// parallel [-j N] command [args...] ::: item...
+// Runs the command once per item, at most N at a time (default: one per CPU).
+// Every "{}" in the arguments is replaced by the item; without any, the item is
+// appended as the last argument. The tasks are external programs started with
+// spawn_program(), all in one foreground job, so Ctrl+C reaches every one of them.
+//
+// Each task's stdout and stderr go to pipes of their own. The oldest unfinished
+// task's output is passed through as it arrives; later tasks are buffered until
+// every task before them is done, so the output appears in item order.
+// The status is the number of failed tasks (101: more than 100).
+
+struct parallel_task {
+  char **argv;
+  int fds[2];                  // Read ends of its stdout/stderr pipes (-1 at EOF)
+  struct line_buffer out[2];   // Held back until it is the oldest unfinished task
+  int done;
+};
+
+// Passes on whatever the task has produced so far
+void parallel_flush(struct parallel_task *task, struct builtin_io *io) {
+  for (int s = 0; s < 2; s++) {
+    write_all(s == 0 ? io->out : io->err, task->out[s].data, task->out[s].len);
+    task->out[s].len = 0;
+  }
+}
+
+// Builds the argv for one item in 'line_arena'
+char **parallel_argv(char **words, int word_count, const char *item) {
+  char **argv = arena_alloc(&line_arena, (word_count + 2) * sizeof(char *));
+  int substituted = 0;
+  size_t item_len = strlen(item);
+
+  for (int i = 0; i < word_count; i++) {
+    const char *word = words[i];
+    const char *hole = strstr(word, "{}");
+    if (hole == NULL) {
+      argv[i] = words[i];
+      continue;
+    }
+    substituted = 1;
+
+    size_t holes = 0;
+    for (const char *p = hole; p != NULL; p = strstr(p + 2, "{}")) holes++;
+    char *arg = arena_alloc(&line_arena, strlen(word) + holes * item_len + 1);
+    char *out = arg;
+    const char *p = word;
+    for (; (hole = strstr(p, "{}")) != NULL; p = hole + 2) {
+      memcpy(out, p, hole - p);
+      out += hole - p;
+      memcpy(out, item, item_len);
+      out += item_len;
+    }
+    strcpy(out, p);
+    argv[i] = arg;
+  }
+
+  int argc = word_count;
+  if (!substituted) argv[argc++] = (char *)item;
+  argv[argc] = NULL;
+  return argv;
+}
+
+// Starts task 'index' with its output going into fresh pipes. Returns 0, or -1 if it could not start.
+int parallel_start(struct parallel_task *task, int index, const char *path, struct job *job) {
+  int out[2], err[2];
+  spawn_failure_status = 126; // Unless spawn_program() says otherwise
+  if (pipe2(out, O_CLOEXEC) < 0) return -1;
+  if (pipe2(err, O_CLOEXEC) < 0) {
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+  for (int k = 0; k < 2; k++) {
+    out[k] = fd_make_private(out[k]);
+    err[k] = fd_make_private(err[k]);
+  }
+
+  // The tasks share the terminal, so none of them gets to read it
+  struct fd_action actions[] = {
+    {FD_ACTION_OPEN, STDIN_FILENO, -1, "/dev/null", O_RDONLY},
+    {FD_ACTION_DUP2, STDOUT_FILENO, out[1], NULL, FD_SOURCE_SHELL},
+    {FD_ACTION_DUP2, STDERR_FILENO, err[1], NULL, FD_SOURCE_SHELL},
+  };
+  // The previous tasks are all reaped, so their process group is gone: lead a new one
+  if (job->live_count == 0) job->pgid = 0;
+
+  pid_t pid = spawn_program(path, task->argv, actions, 3, job);
+  close(out[1]);
+  close(err[1]);
+  if (pid < 0) {
+    close(out[0]);
+    close(err[0]);
+    return -1;
+  }
+  job_add_process(job, index, pid);
+  task->fds[0] = out[0];
+  task->fds[1] = err[0];
+  return 0;
+}
+
+/*
+ * Reaps the task's process once both its pipes are at EOF: right away if its
+ * pidfd says it has exited, or with a blocking wait if there is no pidfd (the
+ * closed pipes say it is gone or about to be).
+ */
+void parallel_reap(struct job *job, int index, struct parallel_task *task) {
+  if (task->fds[0] >= 0 || task->fds[1] >= 0) return;
+  int status;
+  struct rusage usage;
+  pid_t r;
+  int flags = job->pidfds[index] >= 0 ? WNOHANG : 0;
+  while ((r = wait4(job->pids[index], &status, flags, &usage)) < 0 && errno == EINTR) {}
+  if (r > 0) {
+    job_record_status(job, index, status, &usage);
+  } else if (r < 0) {
+    job_forget_process(job, index);
+    job->statuses[index] = 127;
+  }
+}
+
+int shell_parallel(int argc, char *argv[], struct builtin_io *io) {
+  long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+  int i = 1;
+  if (i < argc && strncmp(argv[i], "-j", 2) == 0) {
+    const char *n = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+    char *end;
+    max_running = strtol(n, &end, 10);
+    if (*n == '\0' || *end != '\0' || max_running < 1) {
+      dprintf(io->err, "parallel: -j: invalid number '%s'\n", n);
+      return 2;
+    }
+    i++;
+  }
+
+  int separator = i;
+  while (separator < argc && strcmp(argv[separator], ":::") != 0) separator++;
+  if (separator == i || separator == argc) {
+    dprintf(io->err, "usage: parallel [-j N] command [args...] ::: item...\n");
+    return 2;
+  }
+
+  char *path = ext_check(argv[i]);
+  if (path == NULL) {
+    dprintf(io->err, "parallel: %s: command not found\n", argv[i]);
+    return 127;
+  }
+  path = arena_strdup(&line_arena, path); // ext_check() reuses its buffer
+
+  int task_count = argc - separator - 1;
+  if (max_running > task_count) max_running = task_count > 0 ? task_count : 1;
+  struct parallel_task *tasks = arena_alloc(&line_arena, task_count * sizeof(struct parallel_task));
+  memset(tasks, 0, task_count * sizeof(struct parallel_task));
+  for (int t = 0; t < task_count; t++) {
+    tasks[t].argv = parallel_argv(argv + i, separator - i, argv[separator + 1 + t]);
+    tasks[t].fds[0] = tasks[t].fds[1] = -1;
+  }
+
+  struct timespec start, end;
+  struct rusage usage_before = child_usage;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct job job;
+  job_init(&job, NULL, task_count, 1);
+  terminal_give_to_job(&job);
+
+  // poll() set: 2 pipes + 1 pidfd per running task, and the signalfd
+  struct pollfd *fds = arena_alloc(&line_arena, (3 * max_running + 1) * sizeof(struct pollfd));
+  int *owner = arena_alloc(&line_arena, (3 * max_running + 1) * sizeof(int));
+
+  int next = 0;       // Next task to start
+  int oldest = 0;     // Oldest unfinished task: its output goes straight through
+  int running = 0;
+  int stopped_early = 0; // A task died of SIGINT: start no more
+  while (oldest < task_count) {
+    while (running < max_running && next < task_count && !stopped_early) {
+      if (parallel_start(&tasks[next], next, path, &job) < 0) {
+        if (running > 0) break; // Out of fds or processes: retry once one finishes
+        tasks[next].done = 1;
+        job.statuses[next] = spawn_failure_status;
+      } else {
+        running++;
+      }
+      next++;
+    }
+    if (stopped_early && running == 0) {
+      // Ctrl+C: what was not started counts as failed
+      for (int t = next; t < task_count; t++) {
+        tasks[t].done = 1;
+        job.statuses[t] = 128 + SIGINT;
+      }
+      next = task_count;
+    }
+
+    int nfds = 0;
+    for (int t = oldest; t < next; t++) {
+      if (tasks[t].done) continue;
+      for (int s = 0; s < 2; s++) {
+        if (tasks[t].fds[s] >= 0) {
+          fds[nfds] = (struct pollfd){tasks[t].fds[s], POLLIN, 0};
+          owner[nfds++] = t;
+        }
+      }
+      if (tasks[t].fds[0] < 0 && tasks[t].fds[1] < 0 && job.pidfds[t] >= 0) {
+        fds[nfds] = (struct pollfd){job.pidfds[t], POLLIN, 0};
+        owner[nfds++] = t;
+      }
+    }
+    if (signal_fd >= 0) {
+      fds[nfds] = (struct pollfd){signal_fd, POLLIN, 0};
+      owner[nfds++] = -1;
+    }
+    if (nfds > (signal_fd >= 0) && poll(fds, nfds, -1) < 0 && errno != EINTR) {
+      dprintf(io->err, "parallel: poll: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int f = 0; f < nfds; f++) {
+      if (fds[f].revents == 0) continue;
+      int t = owner[f];
+      if (t < 0) {
+        // A task stopped (Ctrl+Z): a builtin cannot be suspended, so it goes on
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) > 0) {}
+        job_poll(&job);
+        if (job.state == JOB_STOPPED && job_control) {
+          kill(-job.pgid, SIGCONT);
+          job.state = JOB_RUNNING;
+        }
+        continue;
+      }
+      int s = fds[f].fd == tasks[t].fds[0] ? 0 : fds[f].fd == tasks[t].fds[1] ? 1 : -1;
+      if (s < 0) continue; // The pidfd: reaped below
+      struct line_buffer *buf = &tasks[t].out[s];
+      line_buffer_reserve(buf, 65536);
+      ssize_t n = read(fds[f].fd, buf->data + buf->len, 65536);
+      if (n > 0) {
+        buf->len += n;
+        if (t == oldest) parallel_flush(&tasks[t], io);
+      } else if (n == 0 || errno != EINTR) {
+        close(tasks[t].fds[s]);
+        tasks[t].fds[s] = -1;
+      }
+    }
+
+    // Finished tasks: reaped and with both pipes at EOF
+    for (int t = oldest; t < next; t++) {
+      if (tasks[t].done) continue;
+      if (job.pids[t] > 0) parallel_reap(&job, t, &tasks[t]);
+      if (job.pids[t] > 0 || tasks[t].fds[0] >= 0 || tasks[t].fds[1] >= 0) continue;
+      tasks[t].done = 1;
+      running--;
+      if (job.statuses[t] == 128 + SIGINT) stopped_early = 1;
+    }
+    while (oldest < task_count && tasks[oldest].done) {
+      parallel_flush(&tasks[oldest++], io);
+      if (oldest < next) parallel_flush(&tasks[oldest], io); // The new oldest catches up
+    }
+  }
+
+  terminal_take_back(&job);
+
+  int failed = 0;
+  for (int t = 0; t < task_count; t++) {
+    if (job.statuses[t] != 0) failed++;
+    free(tasks[t].out[0].data);
+    free(tasks[t].out[1].data);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double user = timeval_seconds(child_usage.ru_utime) - timeval_seconds(usage_before.ru_utime);
+  double sys = timeval_seconds(child_usage.ru_stime) - timeval_seconds(usage_before.ru_stime);
+  if (stopped_early && job_control) dprintf(io->err, "\n");
+  dprintf(io->err, "parallel: %d tasks, %d failed, up to %ld at a time: %.3fs real, %.3fs user, %.3fs sys\n",
+          task_count, failed, max_running, wall, user, sys);
+  return failed > 100 ? 101 : failed;
+}
+
+// ================================================================================
+// CAT & TEE (zero-copy data movement)
+// ================================================================================
+// cat [-u] [file...] and tee [-a] [file...] as builtins: no exec, and the bytes
+// stay in the kernel whenever the descriptors allow it. As pipeline stages they
+// run in a forked child like any other builtin; as the last stage or on their
+// own they run in the shell itself.
+// Options they do not implement ("cat -n") are passed on to the real program.
+
+enum copy_method { COPY_SPLICE, COPY_FILE_RANGE, COPY_SENDFILE };
+
+// One kernel-side transfer; like read(), 0 means EOF. A pipe moves at most its
+// buffer per call, but file-to-file methods can do a whole file in one go.
+ssize_t copy_step(enum copy_method method, int in, int out) {
+  switch (method) {
+    case COPY_SPLICE:
+      return splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+    case COPY_FILE_RANGE:
+      return copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    default:
+      return sendfile(out, in, NULL, 1 << 30);
+  }
+}
+
+/*
+ * Moves everything left in 'in' to 'out'. Candidates, in order: splice() when
+ * either side is a pipe, copy_file_range() between regular files, sendfile()
+ * from a regular file. A method the kernel refuses for this pair (it fails
+ * before moving a byte: a terminal, an O_APPEND file, another filesystem...)
+ * hands over to the next, and the last resort is a read()/write() loop.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_fd(int in, int out) {
+  struct stat in_st, out_st;
+  if (fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0) return -1;
+
+  enum copy_method methods[3];
+  int count = 0;
+  if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) methods[count++] = COPY_SPLICE;
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) methods[count++] = COPY_FILE_RANGE;
+  if (S_ISREG(in_st.st_mode)) methods[count++] = COPY_SENDFILE;
+
+  for (int m = 0; m < count; m++) {
+    int moved = 0;
+    ssize_t n;
+    while ((n = copy_step(methods[m], in, out)) != 0) {
+      if (n > 0) {
+        moved = 1;
+      } else if (errno != EINTR) {
+        break;
+      }
+    }
+    if (n == 0) return 0;
+    if (moved || !(errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF)) {
+      return -1;
+    }
+  }
+
+  static char buffer[COPY_CHUNK];
+  while (1) {
+    ssize_t n = read(in, buffer, sizeof(buffer));
+    if (n == 0) return 0;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (write_all(out, buffer, n) < 0) return -1;
+  }
+}
+
+// Splices exactly 'len' bytes from pipe 'in' to 'out'. Returns 0, or -1.
+int splice_all(int in, int out, size_t len) {
+  while (len > 0) {
+    ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * tee's copy from a pipe to several outputs without the data leaving the kernel.
+ * Each round tee()s what the input holds into a scratch pipe and splices that
+ * into one output, for every output but the last, which then takes the round
+ * straight from the input (consuming it). Only when every output can be spliced
+ * into: a pipe, or a regular file not opened for append.
+ * Returns 1 when done, 0 if not applicable (nothing was read), -1 on error.
+ */
+int tee_zero_copy(int in, int *outs, int count) {
+  struct stat st;
+  if (fstat(in, &st) < 0 || !S_ISFIFO(st.st_mode)) return 0;
+  for (int i = 0; i < count; i++) {
+    if (fstat(outs[i], &st) < 0) return 0;
+    int append = fcntl(outs[i], F_GETFL) & O_APPEND;
+    if (!S_ISFIFO(st.st_mode) && !(S_ISREG(st.st_mode) && !append)) return 0;
+  }
+
+  int scratch[2];
+  if (pipe2(scratch, O_CLOEXEC) < 0) return 0;
+  // As big as the input, so every tee() of a round sees the same bytes
+  int size = fcntl(in, F_GETPIPE_SZ);
+  if (size > 0) fcntl(scratch[1], F_SETPIPE_SZ, size);
+
+  int result = 1;
+  while (result == 1) {
+    ssize_t round = tee(in, scratch[1], COPY_CHUNK, 0);
+    if (round < 0 && errno == EINTR) continue;
+    if (round <= 0) {
+      if (round < 0) result = -1;
+      break;
+    }
+    for (int i = 0; i < count - 1 && result == 1; i++) {
+      // The first copy of the round is already in the scratch pipe
+      if (i > 0 && tee(in, scratch[1], round, 0) != round) result = -1;
+      if (result == 1 && splice_all(scratch[0], outs[i], round) < 0) result = -1;
+    }
+    if (result == 1 && splice_all(in, outs[count - 1], round) < 0) result = -1;
+  }
+  close(scratch[0]);
+  close(scratch[1]);
+  return result;
+}
+
+/*
+ * Runs the real program for a call the builtin does not handle, as an external
+ * command on the builtin's descriptors. Returns its status, or -1 if there is no
+ * such program.
+ */
+int run_external_instead(int argc, char *argv[], struct builtin_io *io) {
+  char *path = ext_check(argv[0]);
+  if (path == NULL) return -1;
+  int fds[3] = {io->in, io->out, io->err};
+  struct fd_action actions[3];
+  for (int fd = 0; fd < 3; fd++) {
+    actions[fd] = fds[fd] < 0 ? (struct fd_action){FD_ACTION_CLOSE, fd, -1, NULL, 0}
+                              : (struct fd_action){FD_ACTION_DUP2, fd, fds[fd], NULL, FD_SOURCE_SHELL};
+  }
+  struct command cmd = {argc, argv, actions, 3};
+  return execute_external_program(arena_strdup(&line_arena, path), &cmd);
+}
+
+/*
+ * Whether a builtin should leave the call to the real program: 'unsupported'
+ * options, or a call that 'reads_input' from the terminal in an interactive shell,
+ * which keeps the terminal in raw mode and ignores Ctrl+C (in a pipeline's forked
+ * child, neither applies). Runs it and stores its status if so.
+ */
+int delegated_to_program(int argc, char *argv[], struct builtin_io *io, int unsupported, int reads_input, int *status) {
+  if (!unsupported && !(reads_input && job_control && isatty(io->in))) return 0;
+  *status = run_external_instead(argc, argv, io);
+  if (*status >= 0) return 1;
+  if (!unsupported) return 0; // No such program: read the terminal ourselves
+  dprintf(io->err, "%s: unsupported option\n", argv[0]);
+  *status = 2;
+  return 1;
+}
+
+// cat [-u] [file...] -> copies each file ("-" or none: the input) to the output
+int shell_cat(int argc, char *argv[], struct builtin_io *io) {
+  int first = 1;
+  int unsupported = 0;
+  for (; first < argc && argv[first][0] == '-' && argv[first][1] != '\0'; first++) {
+    if (strcmp(argv[first], "--") == 0) {
+      first++;
+      break;
+    }
+    if (strcmp(argv[first], "-u") != 0) unsupported = 1; // -u: we never buffer anyway
+  }
+  int reads_input = first == argc;
+  for (int i = first; i < argc; i++) {
+    if (strcmp(argv[i], "-") == 0) reads_input = 1;
+  }
+  int status;
+  if (delegated_to_program(argc, argv, io, unsupported, reads_input, &status)) return status;
+
+  status = 0;
+  for (int i = first; i < argc || i == first; i++) {
+    const char *name = i < argc ? argv[i] : "-";
+    int fd = strcmp(name, "-") == 0 ? io->in : open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || copy_fd(fd, io->out) < 0) {
+      dprintf(io->err, "cat: %s: %s\n", name, strerror(errno));
+      status = 1;
+    }
+    if (fd >= 0 && fd != io->in) close(fd);
+  }
+  return status;
+}
+
+// tee [-a] [file...] -> copies the input to the output and to every file
+int shell_tee(int argc, char *argv[], struct builtin_io *io) {
+  int first = 1;
+  int append = 0;
+  int unsupported = 0;
+  for (; first < argc && argv[first][0] == '-' && argv[first][1] != '\0'; first++) {
+    if (strcmp(argv[first], "--") == 0) {
+      first++;
+      break;
+    }
+    if (strcmp(argv[first], "-a") == 0) {
+      append = 1;
+    } else {
+      unsupported = 1;
+    }
+  }
+  int status;
+  if (delegated_to_program(argc, argv, io, unsupported, 1, &status)) return status;
+
+  status = 0;
+  int *outs = arena_alloc(&line_arena, (argc - first + 1) * sizeof(int));
+  int count = 0;
+  outs[count++] = io->out;
+  for (int i = first; i < argc; i++) {
+    int fd = open(argv[i], redirect_flags(append) | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      dprintf(io->err, "tee: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    outs[count++] = fd;
+  }
+
+  int done = count == 1 ? (copy_fd(io->in, io->out) == 0 ? 1 : -1) : tee_zero_copy(io->in, outs, count);
+  if (done == 0) {
+    // Some output cannot be spliced into: one read(), then a write() per output
+    static char buffer[COPY_CHUNK];
+    ssize_t n;
+    done = 1;
+    while ((n = read(io->in, buffer, sizeof(buffer))) != 0) {
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        done = -1;
+        break;
+      }
+      for (int i = 0; i < count; i++) {
+        if (outs[i] >= 0 && write_all(outs[i], buffer, n) < 0) {
+          dprintf(io->err, "tee: write error: %s\n", strerror(errno));
+          status = 1;
+          if (i > 0) close(outs[i]);
+          outs[i] = -1; // Keep feeding the others
+        }
+      }
+    }
+  }
+  if (done < 0) {
+    dprintf(io->err, "tee: %s\n", strerror(errno));
+    status = 1;
+  }
+
+  for (int i = 1; i < count; i++) {
+    if (outs[i] >= 0) close(outs[i]);
+  }
+  return status;
+}
+
+// ================================================================================
+// EXIT STATUS & PARAMETER EXPANSION
+// ================================================================================
+// The tokenizer replaces every '$' that starts an expansion (outside single
+// quotes, not escaped) with EXPAND_MARK, in place. The expansion itself happens
+// when the command runs, so "false; echo $?" sees the status of 'false':
+//   $?                    last status
+//   $NAME, ${NAME}        environment variable (empty if unset)
+//   $PIPESTATUS           status of the first stage of the last pipeline
+//   ${PIPESTATUS[N]}      status of stage N; [@] or [*]: all of them, space-separated
+// There is no field splitting: an expansion never turns one word into several.
+
+struct line_buffer expand_scratch; // Reused for every expanded word
+
+void set_pipe_status(const int *statuses, int count) {
+  if (count > pipe_status_capacity) {
+    int *grown = realloc(pipe_status, count * sizeof(int));
+    if (!grown) {
+      perror("realloc");
+      exit(1);
+    }
+    pipe_status = grown;
+    pipe_status_capacity = count;
+  }
+  memcpy(pipe_status, statuses, count * sizeof(int));
+  pipe_status_count = count;
+}
+
+void expand_append_int(struct line_buffer *out, int value) {
+  char text[16];
+  snprintf(text, sizeof(text), "%d", value);
+  line_buffer_append_str(out, text);
+}
+
+// Appends the value of the parameter 'name' ('len' bytes, not NUL-terminated)
+void expand_parameter(struct line_buffer *out, const char *name, size_t len) {
+  if (len == 1 && name[0] == '?') {
+    expand_append_int(out, last_status);
+    return;
+  }
+  if (len >= 10 && strncmp(name, "PIPESTATUS", 10) == 0) {
+    if (len == 10) {
+      if (pipe_status_count > 0) expand_append_int(out, pipe_status[0]);
+      return;
+    }
+    if (name[10] == '[' && name[len - 1] == ']') {
+      const char *index = name + 11;
+      if (len == 13 && (*index == '@' || *index == '*')) {
+        for (int i = 0; i < pipe_status_count; i++) {
+          if (i > 0) line_buffer_append_str(out, " ");
+          expand_append_int(out, pipe_status[i]);
+        }
+        return;
+      }
+      int i = atoi(index);
+      if (i >= 0 && i < pipe_status_count) expand_append_int(out, pipe_status[i]);
+      return;
+    }
+  }
+
+  char key[256];
+  if (len >= sizeof(key)) return;
+  memcpy(key, name, len);
+  key[len] = '\0';
+  const char *value = getenv(key);
+  if (value != NULL) line_buffer_append_str(out, value);
+}
+
+// Returns 'word' itself if it has nothing to expand, else its expansion (in 'line_arena')
+char *expand_word(char *word) {
+  char *mark = word != NULL ? strchr(word, EXPAND_MARK) : NULL;
+  if (mark == NULL) return word;
+
+  struct line_buffer *out = &expand_scratch;
+  out->len = 0;
+  line_buffer_reserve(out, 0);
+  out->data[0] = '\0';
+
+  const char *p = word;
+  while (mark != NULL) {
+    line_buffer_append(out, p, mark - p);
+    p = mark + 1;
+    if (*p == '?') {
+      expand_parameter(out, p, 1);
+      p++;
+    } else if (*p == '{') {
+      const char *close = strchr(p, '}');
+      if (close == NULL) {
+        line_buffer_append_str(out, "$"); // Unterminated: kept as typed
+      } else {
+        expand_parameter(out, p + 1, close - p - 1);
+        p = close + 1;
+      }
+    } else {
+      const char *end = p;
+      while (isalnum((unsigned char)*end) || *end == '_') end++;
+      expand_parameter(out, p, end - p);
+      p = end;
+    }
+    mark = strchr(p, EXPAND_MARK);
+  }
+  line_buffer_append_str(out, p);
+  return arena_strdup(&line_arena, out->data);
+}
+
+// Expands the command's words and redirection targets, just before it runs
+void expand_command(struct command *cmd) {
+  for (int i = 0; i < cmd->argc; i++) {
+    cmd->argv[i] = expand_word(cmd->argv[i]);
+  }
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    struct fd_action *a = &cmd->redirects[i];
+    if (a->kind == FD_ACTION_OPEN) a->path = expand_word((char *)a->path);
+    if (a->kind == FD_ACTION_DATA) a->path = expand_word((char *)a->path);
+  }
+}
+
+// set -e: the shell exits when a command fails, unless it is tested by && / ||
+void errexit_check(int status) {
+  if (!option_errexit || status == 0 || errexit_suppressed > 0) return;
+  fflush(stdout);
+  exit(status);
+}
+
+// ================================================================================
+// PIPELINE & REDIRECTION HELPERS
+// ================================================================================
+
+// A descriptor redirect_in_process() replaced, and a copy of what it was (-1: not open)
+struct saved_fd {
+  int fd;
+  int saved;
+};
+
+/*
+ * Applies the command's redirections to the shell process itself (for a
+ * "{ ...; }" group, whose whole body must see them), saving each descriptor
+ * first. 'saved' has room for cmd->redirect_count entries. Returns how many to
+ * hand to restore_redirections(), or -1 (everything already restored) on failure.
+ */
+int redirect_in_process(struct command *cmd, struct saved_fd *saved) {
+    for (int i = 0; i < cmd->redirect_count; i++) {
+      struct fd_action *a = &cmd->redirects[i];
+      // Above the low numbers scripts use, and not inherited by programs run meanwhile
+      saved[i] = (struct saved_fd){a->fd, fcntl(a->fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN)};
+      if (apply_fd_action(a) < 0) {
+        restore_redirections(saved, i + 1);
+        return -1;
+      }
+    }
+    return cmd->redirect_count;
+}
+
+void restore_redirections(struct saved_fd *saved, int count) {
+    // Backwards, so a descriptor redirected twice gets its original back last
+    for (int i = count - 1; i >= 0; i--) {
+      if (saved[i].saved >= 0) {
+        dup2(saved[i].saved, saved[i].fd);
+        close(saved[i].saved);
+      } else {
+        close(saved[i].fd);
+      }
+    }
+}
+
+// One row of open_builtin_io()'s table: what descriptor 'fd' means to the builtin
+struct builtin_fd {
+  int fd;
+  int target; // -1: closed ("2>&-")
+};
+
+/*
+ * Plays the command's redirections against the builtin's in/out/err instead of
+ * the shell's own fds. An OPEN is one open() whose fd the builtin uses directly
+ * (a heredoc's DATA likewise gets its pipe or memfd);
+ * a DUP2 or CLOSE only re-points a table row, so "2>&1" costs no system call.
+ * Numbers past 2 are tracked too, for "3>log 1>&3"; one that was not redirected
+ * means the shell's own descriptor of that number, if the user could have opened it.
+ * Returns -1 (with nothing left open) if a redirection fails.
+ */
+int open_builtin_io(struct command *cmd, struct builtin_io *io) {
+    io->opened = NULL;
+    io->opened_count = 0;
+    if (cmd->redirect_count == 0) return 0;
+
+    struct builtin_fd *table = arena_alloc(&line_arena, (3 + cmd->redirect_count) * sizeof(struct builtin_fd));
+    table[0] = (struct builtin_fd){STDIN_FILENO, io->in};
+    table[1] = (struct builtin_fd){STDOUT_FILENO, io->out};
+    table[2] = (struct builtin_fd){STDERR_FILENO, io->err};
+    int size = 3;
+    io->opened = arena_alloc(&line_arena, cmd->redirect_count * sizeof(int));
+
+    for (int i = 0; i < cmd->redirect_count; i++) {
+      struct fd_action *a = &cmd->redirects[i];
+      int target = -1;
+      if (a->kind == FD_ACTION_OPEN || a->kind == FD_ACTION_DATA) {
+        target = a->kind == FD_ACTION_DATA ? heredoc_fd(a->path) : fd_make_private(open(a->path, a->flags | O_CLOEXEC, 0666));
+        if (target < 0) {
+          if (a->kind == FD_ACTION_OPEN) fprintf(stderr, "shell: %s: %s\n", a->path, strerror(errno));
+          close_builtin_io(io);
+          return -1;
+        }
+        io->opened[io->opened_count++] = target;
+      } else if (a->kind == FD_ACTION_DUP2) {
+        int j = 0;
+        while (j < size && table[j].fd != a->src_fd) j++;
+        target = j < size ? table[j].target : fd_is_user_visible(a->src_fd) ? a->src_fd : -1;
+        if (target < 0) {
+          fprintf(stderr, "shell: %d: %s\n", a->src_fd, strerror(EBADF));
+          close_builtin_io(io);
+          return -1;
+        }
+      }
+
+      int j = 0;
+      while (j < size && table[j].fd != a->fd) j++;
+      if (j == size) size++;
+      table[j] = (struct builtin_fd){a->fd, target};
+    }
+
+    io->in = table[0].target;
+    io->out = table[1].target;
+    io->err = table[2].target;
+    return 0;
+}
+
+void close_builtin_io(struct builtin_io *io) {
+    for (int i = 0; i < io->opened_count; i++) {
+      close(io->opened[i]);
+    }
+    io->opened_count = 0;
+}
+
+/*
+ * Runs a builtin inside the shell process itself, reading from 'stdin_fd' (if >= 0)
+ * and writing to its redirection targets, all passed as its builtin_io.
+ * If a redirection fails the builtin does not run (status 1); if its output
+ * cannot be written ("echo hi >&-", a full disk) that is reported and the status is 1.
+ */
+int run_builtin_in_process(builtin_func func, struct command *cmd, int stdin_fd) {
+    struct builtin_io io = {stdin_fd >= 0 ? stdin_fd : STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, NULL, 0};
+    if (open_builtin_io(cmd, &io) < 0) return 1;
+
+    builtin_out.fd = io.out;
+    builtin_out.error = 0;
+    int status = func(cmd->argc, cmd->argv, &io);
+    if (out_flush() < 0) {
+      dprintf(io.err, "%s: write error: %s\n", cmd->argv[0], strerror(builtin_out.error));
+      if (status == 0) status = 1;
+    }
+    builtin_out.error = 0;
+    builtin_out.fd = STDOUT_FILENO;
+
+    close_builtin_io(&io);
+    return status;
+}
+
+/*
+ * Runs a syntax tree node in a forked child of the shell: a "( ... )" subshell, a
+ * group or builtin used as a pipeline stage, or a background list. Nothing is
+ * exec'ed: the child joins the job, applies the fd actions, closes the 'inherited'
+ * pipe ends, evaluates the node and exits with its status.
+ */
+pid_t spawn_node(struct node *node, struct fd_action *actions, int action_count, struct job *job,
+                 int *inherited, int inherited_count) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        job_enter_group_in_child(job);
+        // A subshell has no job control and none of the parent's jobs
+        job_control = 0;
+        for (int j = 0; j < job_table_size; j++) {
+            if (job_table[j] != NULL) job_remove(job_table[j]);
+        }
+        apply_fd_actions(actions, action_count);
+        // The pipe ends are O_CLOEXEC, but this child never execs: left open they
+        // would keep later stages from ever seeing EOF. Only those and the shell's
+        // own fds go; the user's ("{ ...; } 3>file") stay usable.
+        for (int i = 0; i < inherited_count; i++) {
+            if (inherited[i] > STDERR_FILENO) close(inherited[i]);
+        }
+        for (int i = 0; i < job->pid_count; i++) {
+            if (job->pidfds[i] >= 0) close(job->pidfds[i]); // Earlier stages'
+            job->pidfds[i] = -1;
+        }
+        if (inotify_fd >= 0) close(inotify_fd);
+        inotify_fd = -1;
+        if (signal_fd >= 0) close(signal_fd);
+        signal_fd = -1;
+        if (event_fd >= 0) close(event_fd);
+        events_init(0); // A fresh epoll set: the inherited one is still the parent's
+
+        int status;
+        if (node->kind == NODE_SUBSHELL) {
+            // This process IS the subshell: its redirections apply for good
+            apply_fd_actions(node->cmd.redirects, node->cmd.redirect_count);
+            status = execute_node(node->body);
+        } else {
+            status = execute_node(node);
+        }
+        fflush(stdout);
+        _exit(status);
+    }
+    return pid;
+}
+
+/*
+ * Executes N commands connected by pipes (cmd1 | cmd2 | ... | cmdN).
+ * 1. Resolves every simple stage's executable up front (builtins need no lookup).
+ * 2. Creates N-1 pipes.
+ * 3. Starts all stages so they run concurrently:
+ *    stage i reads from pipe i-1 and writes to pipe i, and its own
+ *    redirections are applied afterwards (so "cmd > file | next" writes to file).
+ *    Builtins, subshells and groups run in a forked child that skips exec, except
+ *    a builtin as the last stage, which runs in the shell itself once the other
+ *    stages are started (not cat or tee behind a pipe under job control).
+ * 4. Waits for every stage. Returns the last stage's status (with pipefail: the
+ *    last non-zero one), and records each stage's status for PIPESTATUS.
+ *    With 'background', nothing is waited for (and nothing runs in the shell):
+ *    the stages become a job in the table and the status is 0.
+ */
+int run_pipeline(struct node **stages, int stage_count, int background) {
+    char **paths = arena_alloc(&line_arena, stage_count * sizeof(char *));
+    builtin_func *funcs = arena_alloc(&line_arena, stage_count * sizeof(builtin_func));
+
+    // Resolve full paths for executables (ext_check reuses a static buffer, so copy)
+    for (int i = 0; i < stage_count; i++) {
+        paths[i] = NULL;
+        funcs[i] = NULL;
+        struct command *cmd = &stages[i]->cmd;
+        expand_command(cmd); // Subshells and groups: their redirections
+        if (stages[i]->kind != NODE_COMMAND || cmd->argc == 0) continue;
+
+        funcs[i] = find_builtin(cmd->argv[0]);
+        if (funcs[i] != NULL) continue;
+
+        char *path_static = ext_check(cmd->argv[0]);
+        paths[i] = path_static ? arena_strdup(&line_arena, path_static) : NULL;
+
+        // Error handling if a command is not found: run nothing
+        if (!paths[i]) {
+            printf("%s: command not found\n", cmd->argv[0]);
+            int status = 127;
+            set_pipe_status(&status, 1);
+            return status;
+        }
+    }
+
+    // Create the pipes
+    // pipes[i][0] is for reading, pipes[i][1] is for writing (stage i -> stage i+1).
+    // O_CLOEXEC: the original ends close themselves on exec, only the dup2'ed copies survive.
+    // They are the shell's own, so they go above the fd numbers a stage can name ("2>&3").
+    int (*pipes)[2] = arena_alloc(&line_arena, stage_count * sizeof(*pipes));
+    for (int i = 0; i < stage_count - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            return 1;
+        }
+        pipes[i][0] = fd_make_private(pipes[i][0]);
+        pipes[i][1] = fd_make_private(pipes[i][1]);
+    }
+
+    struct job job;
+    job_init(&job, stages, stage_count, !background);
+    if (!background) terminal_give_to_job(&job);
+
+    int in_process = 0;
+    for (int i = 0; i < stage_count; i++) {
+        struct command *cmd = &stages[i]->cmd;
+
+        // cat and tee would block the shell for as long as the other stages write;
+        // with job control they are forked like any stage, so Ctrl+Z still works
+        int streams = funcs[i] == shell_cat || funcs[i] == shell_tee;
+        if (funcs[i] != NULL && i == stage_count - 1 && !background && !(streams && job_control && i > 0)) {
+            // Last stage builtin: no child at all, just read from the last pipe
+            in_process = 1;
+            // The stages already started must be found if the builtin waits ("... | wait")
+            struct job *outer = foreground_job;
+            foreground_job = &job;
+            job.last_status = run_builtin_in_process(funcs[i], cmd, i > 0 ? pipes[i - 1][0] : -1);
+            foreground_job = outer;
+            job.statuses[i] = job.last_status;
+            if (i > 0) close(pipes[i - 1][0]);
+            break;
+        }
+
+        // Up to three for stdin and the pipes, then the command's own
+        struct fd_action *actions = arena_alloc(&line_arena, (3 + cmd->redirect_count) * sizeof(struct fd_action));
+        int count = 0;
+
+        // Without job control a background job must not compete for our input
+        if (background && !job_control && i == 0) {
+            actions[count++] = (struct fd_action){FD_ACTION_OPEN, STDIN_FILENO, -1, "/dev/null", O_RDONLY};
+        }
+
+        // Connect stdin to the previous pipe and stdout to the next one
+        if (i > 0) {
+            actions[count++] = (struct fd_action){FD_ACTION_DUP2, STDIN_FILENO, pipes[i - 1][0], NULL, FD_SOURCE_SHELL};
+        }
+        if (i < stage_count - 1) {
+            actions[count++] = (struct fd_action){FD_ACTION_DUP2, STDOUT_FILENO, pipes[i][1], NULL, FD_SOURCE_SHELL};
+        }
+
+        pid_t pid;
+        if (paths[i] != NULL) {
+            // The stage's own redirections, in the order they were written
+            for (int r = 0; r < cmd->redirect_count; r++) {
+                actions[count++] = cmd->redirects[r];
+            }
+            pid = spawn_program(paths[i], cmd->argv, actions, count, &job);
+        } else {
+            // Every pipe end the shell still holds; the child keeps only its dup2'ed copies
+            int *inherited = arena_alloc(&line_arena, 2 * stage_count * sizeof(int));
+            int inherited_count = 0;
+            if (i > 0) inherited[inherited_count++] = pipes[i - 1][0];
+            for (int j = i; j < stage_count - 1; j++) {
+                inherited[inherited_count++] = pipes[j][0];
+                inherited[inherited_count++] = pipes[j][1];
+            }
+            // The child evaluates the node, which applies the stage's own redirections
+            pid = spawn_node(stages[i], actions, count, &job, inherited, inherited_count);
+        }
+        if (pid > 0) {
+            job_add_process(&job, i, pid);
+        } else {
+            job.statuses[i] = paths[i] != NULL ? spawn_failure_status : 127;
+            if (i == stage_count - 1) job.last_status = job.statuses[i];
+        }
+
+        // The parent is done with the pipe ends this stage inherited.
+        // If we don't close them, later stages might hang waiting for EOF.
+        if (i > 0) close(pipes[i - 1][0]);
+        if (i < stage_count - 1) close(pipes[i][1]);
+    }
+
+    if (background) {
+        int status = job.live_count == 0 ? 1 : 0; // 1: nothing could be started
+        set_pipe_status(&status, 1);
+        if (status != 0) return status;
+        struct job *added = job_add(&job);
+        if (job_control) {
+            printf("[%d] %d\n", added->id, (int)added->pgid);
+        }
+        return 0;
+    }
+
+    // Wait for every stage to finish (or for Ctrl+Z)
+    int builtin_status = job.last_status;
+    int status = wait_for_job(&job);
+    if (job.state == JOB_STOPPED) {
+        set_pipe_status(&status, 1);
+        return status;
+    }
+    if (in_process) status = builtin_status;
+    if (option_pipefail) {
+        for (int i = 0; i < stage_count; i++) {
+            if (job.statuses[i] != 0) status = job.statuses[i];
+        }
+    }
+    set_pipe_status(job.statuses, stage_count);
+    return status;
+}
+
 /*
- * Manual tokenizer that splits a string into arguments (argv).
- * Handles:
- * - Single quotes ('foo bar' is one arg)
- * - Double quotes ("foo bar" is one arg)
- * - Backslash escaping (\)
+ * Runs a single (non-pipeline) command: Built-in or External, with optional redirection.
+ * Returns its exit status (127 if the command does not exist).
  */
-int parse_command(const char *line, char *argv[], int max_args) {
-  int argc = 0;
-  int in_single_quote = 0;
-  int in_double_quote = 0;
-  char token[1024]; // Temporary buffer for building the current argument
-  int len = 0;
+int execute_command(struct command *cmd) {
+    expand_command(cmd);
+    if (cmd->argc == 0) {
+      // Only redirections ("> file"): create/truncate the targets, run nothing
+      struct builtin_io io = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, NULL, 0};
+      if (open_builtin_io(cmd, &io) < 0) return 1;
+      close_builtin_io(&io);
+      return 0;
+    }
 
-  for (const char *p = line;; p++) {
-    char c = *p;
+    char *cmd_name = cmd->argv[0];
 
-    // Toggle single quote state (unless inside double quotes)
-    if (!in_double_quote && c == '\'') {
-      in_single_quote = !in_single_quote;
-      continue; // Skip adding the quote char itself to the token
+    // 1. Try to execute as Built-in
+    builtin_func func = find_builtin(cmd_name);
+    if (func != NULL) {
+      return run_builtin_in_process(func, cmd, -1);
     }
 
-    // Toggle double quote state (unless inside single quotes)
-    if (!in_single_quote && c == '"') {
-      in_double_quote = !in_double_quote;
-      continue;
+    // 2. Try to execute as External Program
+    char *full_path = ext_check(cmd_name);
+    if (full_path != NULL){
+      return execute_external_program(full_path, cmd);
     }
+    printf("%s: command not found\n", cmd_name);
+    return 127;
+}
 
-    // Check for delimiter (Space or Null terminator)
-    // Only treat space as delimiter if we are NOT inside quotes
-    if ((c == '\0') || (!in_single_quote && !in_double_quote && isspace((unsigned char)c))) {
-      if (len > 0) {
-        token[len] = '\0'; // Terminate the string
-        if (argc < max_args - 1) {
-          argv[argc++] = strdup(token); // Allocate memory for the arg
-        }
-        len = 0; // Reset token builder
+// ================================================================================
+// TREE-WALKING EVALUATOR
+// ================================================================================
+
+/*
+ * Evaluates one syntax tree node and returns its exit status (0 = success).
+ * '&&' runs its right side only after success, '||' only after failure.
+ */
+int evaluate_node(struct node *node) {
+    switch (node->kind) {
+      case NODE_COMMAND: {
+        int status = execute_command(&node->cmd);
+        set_pipe_status(&status, 1);
+        return status;
       }
-      if (c == '\0') break; // End of line
-      continue;
-    }
 
-    // Handle escapes inside double quotes (allows \" and \\)
-    if (in_double_quote && c == '\\') {
-      char next = *(++p);
-      if (next == '\0') break; 
-      if (next == '"' || next == '\\') {
-        c = next; 
-      } else {
-        // If not a special escape, keep the backslash literal
-        if (len < (int)sizeof(token) - 1) {
-          token[len++] = '\\';
+      case NODE_PIPELINE:
+        return run_pipeline(node->stages, node->stage_count, 0);
+
+      case NODE_AND:
+      case NODE_OR: {
+        // The left side is being tested: its failure must not trigger set -e
+        errexit_suppressed++;
+        int status = execute_node(node->left);
+        errexit_suppressed--;
+        int run_right = node->kind == NODE_AND ? status == 0 : status != 0;
+        return run_right ? execute_node(node->right) : status;
+      }
+
+      case NODE_SEQUENCE:
+        execute_node(node->left);
+        return execute_node(node->right);
+
+      case NODE_SUBSHELL:
+        // A one-stage job: changes made inside (cd, exit, ...) stay in the child
+        return run_pipeline(&node, 1, 0);
+
+      case NODE_GROUP: {
+        expand_command(&node->cmd);
+        struct saved_fd *saved = arena_alloc(&line_arena, (node->cmd.redirect_count + 1) * sizeof(struct saved_fd));
+        int saved_count = redirect_in_process(&node->cmd, saved);
+        if (saved_count < 0) return 1;
+        int status = execute_node(node->body);
+        restore_redirections(saved, saved_count);
+        return status;
+      }
+
+      case NODE_BACKGROUND: {
+        // A pipeline keeps its stages; anything else runs as one forked stage
+        struct node *body = node->body;
+        if (body->kind == NODE_PIPELINE) {
+          return run_pipeline(body->stages, body->stage_count, 1);
         }
-        c = next;
+        return run_pipeline(&node->body, 1, 1);
       }
+
+      case NODE_TIME:
+        return execute_timed(node->body);
     }
+    return 1;
+}
 
-    // Handle escapes outside quotes (generic escaping)
-    if (!in_single_quote && !in_double_quote && c == '\\') {
-      char next = *(++p);
-      if (next == '\0') break;
-      c = next;
+// Runs a node and keeps $? up to date; with set -e, a failed command ends the shell
+int execute_node(struct node *node) {
+    int status = evaluate_node(node);
+    last_status = status;
+    if (node->kind == NODE_COMMAND || node->kind == NODE_PIPELINE || node->kind == NODE_SUBSHELL) {
+      errexit_check(status);
     }
+    return status;
+}
+
+// ================================================================================
+// HERE-DOCUMENTS
+// ================================================================================
+// A heredoc's body is the input lines after its command line, up to the
+// delimiter. The parser only records which DATA actions need one; once the line
+// is parsed, read_heredoc_bodies() pulls the lines from wherever the command line
+// came from (the terminal, a script, a -c string) through 'read_heredoc_line'.
+// Bodies are kept in 'line_arena' like the rest of the line, and turned into a
+// pipe or memfd by heredoc_fd() only when the command runs.
+
+struct pending_heredoc {
+  struct fd_action *action; // DATA action that receives the body
+  const char *delimiter;
+  int strip_tabs;           // <<- : leading tabs are dropped from every line
+  int expand;               // Unquoted delimiter: '$' expansions apply to the body
+  struct pending_heredoc *next;
+};
+
+// Heredocs of the current line, in the order their bodies follow it
+struct pending_heredoc *heredocs_first;
+struct pending_heredoc **heredocs_tail = &heredocs_first;
 
-    // Append char to current token
-    if (len < (int)sizeof(token) - 1) {
-      token[len++] = c;
+// Set by each input mode; returns 1 with the next line in 'line', 0 at end of input
+int (*read_heredoc_line)(struct line_buffer *line);
+
+struct line_buffer heredoc_line; // Not 'input_line': the command line's tokens point into it
+struct line_buffer heredoc_body;
+
+void heredoc_push(struct fd_action *action, const char *delimiter, int strip_tabs, int expand) {
+  struct pending_heredoc *doc = arena_alloc(&line_arena, sizeof(struct pending_heredoc));
+  *doc = (struct pending_heredoc){action, delimiter, strip_tabs, expand, NULL};
+  *heredocs_tail = doc;
+  heredocs_tail = &doc->next;
+}
+
+// Interactive continuation lines get their own prompt
+int read_heredoc_interactive(struct line_buffer *line) {
+  printf("> ");
+  return read_input_line(line);
+}
+
+/*
+ * Appends one body line. With 'expand', a '$' that starts an expansion becomes
+ * EXPAND_MARK (as the tokenizer does for words) and "\$" / "\\" lose their
+ * backslash; expand_word() does the rest when the command runs.
+ */
+void heredoc_append_line(const char *text, int expand) {
+  if (!expand) {
+    line_buffer_append_str(&heredoc_body, text);
+  } else {
+    const char *p = text;
+    while (*p != '\0') {
+      size_t run = strcspn(p, "$\\");
+      line_buffer_append(&heredoc_body, p, run);
+      p += run;
+      if (*p == '\0') break;
+      if (*p == '\\' && (p[1] == '$' || p[1] == '\\')) {
+        line_buffer_append(&heredoc_body, p + 1, 1);
+        p += 2;
+      } else if (*p == '$' && (p[1] == '?' || p[1] == '{' || p[1] == '_' || isalpha((unsigned char)p[1]))) {
+        line_buffer_append(&heredoc_body, (char[]){EXPAND_MARK}, 1);
+        p++;
+      } else {
+        line_buffer_append(&heredoc_body, p, 1);
+        p++;
+      }
     }
   }
+  line_buffer_append(&heredoc_body, "\n", 1);
+}
 
-  argv[argc] = NULL;
-  return argc;
+// Reads the bodies of the heredocs the last parsed line announced
+void read_heredoc_bodies() {
+  for (struct pending_heredoc *doc = heredocs_first; doc != NULL; doc = doc->next) {
+    heredoc_body.len = 0;
+    line_buffer_reserve(&heredoc_body, 0);
+    heredoc_body.data[0] = '\0';
+
+    int found = 0;
+    while (read_heredoc_line != NULL && read_heredoc_line(&heredoc_line)) {
+      const char *text = heredoc_line.data;
+      if (doc->strip_tabs) text += strspn(text, "\t");
+      if (strcmp(text, doc->delimiter) == 0) {
+        found = 1;
+        break;
+      }
+      heredoc_append_line(text, doc->expand);
+    }
+    if (!found) {
+      fprintf(stderr, "shell: warning: here-document delimited by end-of-file (wanted `%s')\n", doc->delimiter);
+    }
+    doc->action->path = arena_strdup(&line_arena, heredoc_body.data);
+  }
+  heredocs_first = NULL;
+  heredocs_tail = &heredocs_first;
 }
 
 // ================================================================================
-// RAW INPUT HANDLER
+// MAIN ENTRY POINT
 // ================================================================================
 
 /*
- * Finds the longest common prefix among a list of strings.
- * Returns a newly allocated string that must be freed by the caller.
- * 
- * Logic:
- * 1. Start with the first string as the candidate prefix.
- * 2. Iterate through the rest of the strings.
- * 3. For each string, shorten the candidate prefix until it matches the start of the string.
+ * Parses and runs one line of input: tokens -> syntax tree -> evaluation.
+ * All parse data lives in 'line_arena' (tokens in the reused 'line_tokens'),
+ * which is reset once the line is done. Returns the line's exit status.
  */
-char *find_lcp(char **matches, int count) {
-    if (count == 0) return NULL;
-    if (count == 1) return strdup(matches[0]);
-    
-    char *prefix = strdup(matches[0]);
-    int len = strlen(prefix);
-    
-    for (int i = 1; i < count; i++) {
-        int j = 0;
-        // Compare characters until mismatch or end of string
-        while (j < len && matches[i][j] != '\0' && prefix[j] == matches[i][j]) {
-            j++;
-        }
-        len = j; // Update length of common prefix
-        prefix[len] = '\0'; // Terminate string at new length
+int execute_line(char *line) {
+    int status = 0;
+    int count = tokenize_line(line, &line_tokens);
+    if (count > 0) {
+      struct node *root = parse_line(line_tokens.items, count);
+      read_heredoc_bodies(); // Even after a syntax error: the body lines are not commands
+      status = root != NULL ? execute_node(root) : 2; // 2: syntax error, as in other shells
+      last_status = status;
     }
-    return prefix;
-}
 
-/* * Reads input byte-by-byte to handle specialized keys (TAB, Backspace).
- * Returns 1 if command entered, 0 on EOF (Ctrl+D).
- */
-int read_input_line(char *buffer, size_t size) {
-  size_t len = 0;
-  int tab_count = 0; // Track consecutive tabs
-  memset(buffer, 0, size);
+    // Release every argv array, tree node and pipeline bookkeeping of this line at once
+    arena_reset(&line_arena);
 
-  while (1) {
-    char c;
-    // read() from STDIN_FILENO returns 1 byte. In Raw Mode, this returns immediately.
-    if (read(STDIN_FILENO, &c, 1) != 1) break; 
+    // Report (and forget) jobs that finished or stopped in the background
+    job_reap();
+    job_notify();
+    return status;
+}
 
-    // Handle Ctrl+D (EOF - Value 4)
-    if (c == 4) { 
-        if (len == 0) return 0; // If line is empty, signal exit
-        break; 
-    }
-    
-    // Handle Enter/Return (Carriage Return or Newline)
-    if (c == '\n' || c == '\r') {
-      printf("\n"); // Move to new line visually for the user
-      buffer[len] = '\0';
-      return 1;
-    }
+// ================================================================================
+// SCRIPT MODE (non-interactive input)
+// ================================================================================
+// No prompt, no echo, no key handling: lines are executed back-to-back.
 
-    // === TAB COMPLETION ===
-    if (c == '\t') {
-      // 1. Isolate the last word the user was typing
-      int start = 0;
-      while (start < len && (buffer[start] == ' ' || buffer[start] == '\t')) {
-        start++;
-      }
-      
-      char prefix[128];
-      int i = 0;
-      while (start + i < len && !isspace((unsigned char)buffer[start + i]) && i < (int)sizeof(prefix) - 1) {
-        prefix[i] = buffer[start + i];
-        i++;
-      }
-      prefix[i] = '\0';
+// A script read from stdin shares that fd with the commands it runs ("head -n1"
+// reads the script's next line), so nothing past the current line may be taken:
+// - SCRIPT_SEEKABLE (a file): chunks are read with pread(), and the fd's offset is
+//   put right after each line before it runs; a command that moved it is followed.
+// - SCRIPT_PEEK (a pipe): tee() copies what the pipe holds into a scratch pipe
+//   without consuming it, and only the bytes up to the first newline are read.
+// - SCRIPT_BYTEWISE (anything else): one byte per read(), as other shells do.
+// A script the shell opened itself is SCRIPT_PRIVATE: plain 64 KiB reads.
+enum script_input { SCRIPT_PRIVATE, SCRIPT_SEEKABLE, SCRIPT_PEEK, SCRIPT_BYTEWISE };
 
-      char **matches = NULL;
-      int match_count = get_completions(prefix, &matches);
+enum script_input script_input;
+off_t script_offset;               // SCRIPT_SEEKABLE: file offset of the ring's next unread byte
+int script_peek[2] = {-1, -1};     // SCRIPT_PEEK: the scratch pipe
 
-      if (match_count == 0) {
-          printf("\a"); // Bell sound
-          fflush(stdout);
-          tab_count = 0;
-      } else if (match_count == 1) {
-          // Autocomplete
-          size_t prefix_len = strlen(prefix);
-          size_t comp_len = strlen(matches[0]);
-          
-          if (len + (comp_len - prefix_len) + 1 < size) {
-              printf("%s ", matches[0] + prefix_len); // Visual update
-              fflush(stdout);
-
-              // Buffer update
-              strcpy(buffer + len, matches[0] + prefix_len);
-              len += (comp_len - prefix_len);
-              buffer[len++] = ' ';
-              buffer[len] = '\0';
-          }
-          tab_count = 0;
-      } else {
-          // Multiple matches found
-          // Calculate the Longest Common Prefix (LCP) of all matches
-          char *lcp = find_lcp(matches, match_count);
-          size_t prefix_len = strlen(prefix);
-          size_t lcp_len = strlen(lcp);
+// Adds the next chunk of the script to the ring, without reading past a line the
+// commands may still read. Returns the byte count, 0 on EOF, -1 on error.
+ssize_t script_ring_fill(int fd) {
+  if (script_input == SCRIPT_PRIVATE) return input_ring_fill(fd);
 
-          // If the LCP is longer than what the user has typed so far,
-          // we can auto-complete up to the LCP.
-          if (lcp_len > prefix_len) {
-              if (len + (lcp_len - prefix_len) < size) {
-                  printf("%s", lcp + prefix_len); // Print only the new characters
-                  fflush(stdout);
-                  
-                  // Append new characters to the buffer
-                  strcpy(buffer + len, lcp + prefix_len);
-                  len += (lcp_len - prefix_len);
-                  buffer[len] = '\0';
-              }
-              tab_count = 0; // Reset tab count so next tab triggers list
-          } else {
-              // If we can't extend the prefix (LCP == current input),
-              // behave like standard shell:
-              // 1st Tab: Bell
-              // 2nd Tab: List all matches
-              if (tab_count == 0) {
-                  printf("\a"); // Bell sound
-                  fflush(stdout);
-                  tab_count = 1;
-              } else {
-                  printf("\n");
-                  for (int j = 0; j < match_count; j++) {
-                      printf("%s  ", matches[j]);
-                  }
-                  printf("\n");
-                  printf("$ %s", buffer); // Reprint prompt and buffer
-                  fflush(stdout);
-                  tab_count = 0;
-              }
-          }
-          free(lcp);
-      }
+  size_t used = input_ring.tail - input_ring.head;
+  size_t start = input_ring.tail & (INPUT_RING_SIZE - 1);
+  size_t room = INPUT_RING_SIZE - start; // Contiguous free space only: one call
+  if (room > INPUT_RING_SIZE - used) room = INPUT_RING_SIZE - used;
+  if (room == 0) return -1;
+  char *dest = input_ring.data + start;
 
-      // Free matches
-      for (int j = 0; j < match_count; j++) {
-          free(matches[j]);
-      }
-      free(matches);
-      
-      continue;
+  ssize_t n;
+  if (script_input == SCRIPT_SEEKABLE) {
+    n = pread(fd, dest, room, script_offset + used);
+  } else if (script_input == SCRIPT_PEEK) {
+    // A small peek: the copy is thrown away past the first newline
+    n = tee(fd, script_peek[1], room < SCRIPT_PEEK_SIZE ? room : SCRIPT_PEEK_SIZE, 0);
+    if (n < 0 && errno == EINVAL) {
+      script_input = SCRIPT_BYTEWISE; // Not a pipe after all
+      return script_ring_fill(fd);
     }
+    if (n > 0) {
+      // Find the newline in the copy, then consume just that much of the real thing
+      n = read(script_peek[0], dest, n);
+      if (n <= 0) return -1;
+      char *newline = memchr(dest, '\n', n);
+      n = read(fd, dest, newline ? (size_t)(newline - dest) + 1 : (size_t)n);
+    }
+  } else {
+    n = read(fd, dest, 1);
+  }
+  if (n > 0) input_ring.tail += n;
+  return n;
+}
 
-    // Reset tab count for any other key
-    tab_count = 0;
+/*
+ * Reads one line from a non-interactive fd through the input ring (memchr for
+ * the newline) into 'line', which grows to fit.
+ * Returns 1 if a line was read, 0 at end of input.
+ */
+int read_script_line(int fd, struct line_buffer *line) {
+  int got_any = 0;
+  line->len = 0;
+  line_buffer_reserve(line, 0);
+  line->data[0] = '\0';
 
-    // === BACKSPACE HANDLING ===
-    // 127 is Standard DEL, \b is used in some terminals.
-    if (c == 127 || c == '\b') {
-      if (len > 0) {
-        len--;
-        buffer[len] = '\0';
-        // Visual erase trick: Move cursor back (\b), print Space ( ), move cursor back again (\b)
-        printf("\b \b");
-        fflush(stdout);
-      }
+  if (script_input == SCRIPT_SEEKABLE) {
+    off_t now = lseek(fd, 0, SEEK_CUR);
+    if (now != script_offset) {
+      // The last command read (or seeked) the script's fd: go on from there
+      input_ring_consume(input_ring.tail - input_ring.head);
+      script_offset = now;
+    }
+  }
+
+  while (1) {
+    const char *pending;
+    size_t avail = input_ring_contiguous(&pending);
+    if (avail == 0) {
+      ssize_t n = script_ring_fill(fd);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break; // EOF: a last line without '\n' still counts
       continue;
     }
+    got_any = 1;
 
-    // Handle Normal Characters
-    if (len < size - 1) {
-      if (iscntrl(c)) continue; // Ignore other weird control characters
-      
-      buffer[len++] = c;
-      printf("%c", c); // We must manually ECHO the character back to the user
-      fflush(stdout);
+    const char *newline = memchr(pending, '\n', avail);
+    size_t run = newline ? (size_t)(newline - pending) : avail;
+    line_buffer_append(line, pending, run);
+
+    input_ring_consume(run + (newline ? 1 : 0));
+    if (script_input == SCRIPT_SEEKABLE) script_offset += run + (newline ? 1 : 0);
+    if (newline) break;
+  }
+
+  // The commands of this line start reading right after it
+  if (script_input == SCRIPT_SEEKABLE) lseek(fd, script_offset, SEEK_SET);
+  return got_any;
+}
+
+int script_fd = -1; // What run_script_fd() reads, for heredoc bodies too
+
+int read_script_fd_line(struct line_buffer *line) {
+  return read_script_line(script_fd, line);
+}
+
+// Whether the commands can read what 'fd' reads: it is stdin, or the same pipe ("shell /dev/stdin")
+int shares_stdin(int fd) {
+  struct stat a, b;
+  if (fd == STDIN_FILENO) return 1;
+  return fstat(fd, &a) == 0 && fstat(STDIN_FILENO, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Runs every line read from a pipe, FIFO or other non-mappable fd, or from stdin.
+void run_script_fd(int fd) {
+  script_fd = fd;
+  read_heredoc_line = read_script_fd_line;
+  script_input = SCRIPT_PRIVATE;
+  if (shares_stdin(fd)) {
+    script_offset = lseek(fd, 0, SEEK_CUR);
+    if (script_offset >= 0) {
+      script_input = SCRIPT_SEEKABLE;
+    } else if (pipe2(script_peek, O_CLOEXEC) == 0) {
+      script_peek[0] = fd_make_private(script_peek[0]);
+      script_peek[1] = fd_make_private(script_peek[1]);
+      script_input = SCRIPT_PEEK;
+    } else {
+      script_input = SCRIPT_BYTEWISE;
     }
   }
-  return 1;
+  while (read_script_line(fd, &input_line)) {
+    execute_line(input_line.data);
+  }
 }
 
-// ================================================================================
-// PIPELINE & REDIRECTION HELPERS
-// ================================================================================
+// The unread part of the script run_script_text() is executing
+char *script_text_next;
+char *script_text_end;
+
+// Copies the next script line out (heredoc bodies are not terminated in place)
+int read_script_text_line(struct line_buffer *line) {
+  if (script_text_next >= script_text_end) return 0;
+  char *newline = memchr(script_text_next, '\n', script_text_end - script_text_next);
+  size_t run = newline ? (size_t)(newline - script_text_next) : (size_t)(script_text_end - script_text_next);
+  line->len = 0;
+  line_buffer_reserve(line, 0);
+  line->data[0] = '\0';
+  line_buffer_append(line, script_text_next, run);
+  script_text_next += run + (newline ? 1 : 0);
+  return 1;
+}
 
 /*
- * Scans the argument list for redirection operators (>, >>, 2>, 2>>).
- * Extracts the target filename and sets the appropriate flags.
- * Removes the operator and filename from argv by shifting remaining arguments.
+ * Runs every line of an in-memory script. Lines are NUL-terminated in place, so
+ * 'text' must be writable; a last line without '\n' has no room for that and
+ * runs from a copy.
  */
-void parse_redirections(int *argc_ptr, char *argv[], char **redirect_out, char **redirect_err, int *redirect_out_append, int *redirect_err_append) {
-    int argc = *argc_ptr;
-    *redirect_out = NULL;
-    *redirect_err = NULL;
-    *redirect_out_append = 0;
-    *redirect_err_append = 0;
-    
-    for (int i = 0; i < argc; i++) {
-      int remove_count = 0;
-      // Check for Standard Output Redirection
-      if (strcmp(argv[i], ">") == 0 || strcmp(argv[i], "1>") == 0) {
-        if (i + 1 < argc) {
-          *redirect_out = argv[i + 1];
-          *redirect_out_append = 0; // Truncate mode
-          remove_count = 2;
-        }
-      } 
-      // Check for Append Standard Output
-      else if (strcmp(argv[i], ">>") == 0 || strcmp(argv[i], "1>>") == 0) {
-        if (i + 1 < argc) {
-          *redirect_out = argv[i + 1];
-          *redirect_out_append = 1; // Append mode
-          remove_count = 2;
-        }
-      } 
-      // Check for Standard Error Redirection
-      else if (strcmp(argv[i], "2>") == 0) {
-        if (i + 1 < argc) {
-          *redirect_err = argv[i + 1];
-          *redirect_err_append = 0;
-          remove_count = 2;
-        }
-      } 
-      // Check for Append Standard Error
-      else if (strcmp(argv[i], "2>>") == 0) {
-        if (i + 1 < argc) {
-          *redirect_err = argv[i + 1];
-          *redirect_err_append = 1;
-          remove_count = 2;
-        }
-      }
-
-      // If a redirection was found, remove the operator and filename from argv
-      if (remove_count > 0) {
-          free(argv[i]); // Free the operator string
-          // Shift remaining arguments left to fill the gap
-          for (int j = i; j + remove_count <= argc; j++) {
-              argv[j] = argv[j + remove_count];
-          }
-          argc -= remove_count;
-          i -= 1; // Decrement i to re-check the new argument at this position
-      }
+void run_script_text(char *text, size_t len) {
+  script_text_next = text;
+  script_text_end = text + len;
+  read_heredoc_line = read_script_text_line;
+  while (script_text_next < script_text_end) {
+    char *line = script_text_next;
+    char *newline = memchr(line, '\n', script_text_end - line);
+    if (newline == NULL) {
+      read_script_text_line(&input_line);
+      execute_line(input_line.data);
+      break;
     }
-    *argc_ptr = argc; // Update the caller's argc
+    *newline = '\0';
+    script_text_next = newline + 1; // Before executing: heredoc bodies start here
+    execute_line(line);
+  }
 }
 
 /*
- * Executes two commands connected by a pipe (|).
- * 1. Parses redirections for both commands.
- * 2. Creates a pipe.
- * 3. Forks two child processes.
- * 4. Connects stdout of Child 1 to the write end of the pipe.
- * 5. Connects stdin of Child 2 to the read end of the pipe.
+ * "shell file.sh": regular files are mmap'ed (private, copy-on-write, so lines can
+ * be terminated in place) and executed straight from the mapping. Anything that
+ * cannot be mapped (pipes, /dev/stdin...) is stream-read instead.
+ * Returns the shell's exit status.
  */
-void run_pipeline(int argc1, char *argv1[], int argc2, char *argv2[]) {
-    char *out1=NULL, *err1=NULL, *out2=NULL, *err2=NULL;
-    int out1_app=0, err1_app=0, out2_app=0, err2_app=0;
-    
-    // Parse redirections for both commands independently
-    parse_redirections(&argc1, argv1, &out1, &err1, &out1_app, &err1_app);
-    parse_redirections(&argc2, argv2, &out2, &err2, &out2_app, &err2_app);
+int run_script_file(const char *path) {
+  int fd = fd_make_private(open(path, O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+    return 127;
+  }
 
-    // Resolve full paths for executables
-    char *path1_static = ext_check(argv1[0]);
-    char *path1 = path1_static ? strdup(path1_static) : NULL;
-    
-    char *path2_static = ext_check(argv2[0]);
-    char *path2 = path2_static ? strdup(path2_static) : NULL;
-    
-    // Error handling if commands are not found
-    if (!path1) { 
-        printf("%s: command not found\n", argv1[0]); 
-        if(path2) free(path2); 
-        if(out1) free(out1); if(err1) free(err1);
-        if(out2) free(out2); if(err2) free(err2);
-        return; 
-    }
-    if (!path2) { 
-        printf("%s: command not found\n", argv2[0]); 
-        if(path1) free(path1); 
-        if(out1) free(out1); if(err1) free(err1);
-        if(out2) free(out2); if(err2) free(err2);
-        return; 
-    }
-
-    // Create the pipe
-    // pipefd[0] is for reading, pipefd[1] is for writing
-    int pipefd[2];
-    if (pipe(pipefd) < 0) { 
-        perror("pipe"); 
-        free(path1); free(path2); 
-        if(out1) free(out1); if(err1) free(err1);
-        if(out2) free(out2); if(err2) free(err2);
-        return; 
-    }
-
-    // Fork first child (Command 1)
-    pid_t pid1 = fork();
-    if (pid1 == 0) {
-        // === CHILD 1 ===
-        close(pipefd[0]); // Close unused read end
-        dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to pipe write end
-        close(pipefd[1]); // Close original write end after dup
-        
-        // Handle other redirections (stderr)
-        if (err1) setup_redirect_fd(err1, STDERR_FILENO, 1, err1_app);
-        
-        execv(path1, argv1);
-        perror("execv");
-        exit(1);
-    }
-
-    // Fork second child (Command 2)
-    pid_t pid2 = fork();
-    if (pid2 == 0) {
-        // === CHILD 2 ===
-        close(pipefd[1]); // Close unused write end
-        dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to pipe read end
-        close(pipefd[0]); // Close original read end after dup
-
-        // Handle other redirections (stdout, stderr)
-        if (out2) setup_redirect_fd(out2, STDOUT_FILENO, 1, out2_app);
-        if (err2) setup_redirect_fd(err2, STDERR_FILENO, 1, err2_app);
-
-        execv(path2, argv2);
-        perror("execv");
-        exit(1);
-    }
-
-    // === PARENT PROCESS ===
-    // Close both ends of the pipe in the parent
-    // If we don't close them, the children might hang waiting for EOF
-    close(pipefd[0]);
-    close(pipefd[1]);
-    
-    // Wait for both children to finish
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
-    
-    // Cleanup
-    free(path1);
-    free(path2);
-    if(out1) free(out1); if(err1) free(err1);
-    if(out2) free(out2); if(err2) free(err2);
-}
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size_t size = st.st_size;
+    if (size == 0) {
+      close(fd);
+      return 0;
+    }
+    char *text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      close(fd);
+      run_script_text(text, size);
+      munmap(text, size);
+      return last_status;
+    }
+  }
 
-// ================================================================================
-// MAIN ENTRY POINT
-// ================================================================================
+  run_script_fd(fd);
+  close(fd);
+  return last_status;
+}
 
 int main(int argc, char *argv[]) {
+  // Script mode: "shell -c 'commands'" or "shell file.sh"
+  char *command_string = NULL;
+  char *script_path = NULL;
+  if (argc >= 2) {
+    if (strcmp(argv[1], "-c") == 0) {
+      if (argc < 3) {
+        fprintf(stderr, "shell: -c: option requires an argument\n");
+        return 2;
+      }
+      command_string = argv[2];
+    } else {
+      script_path = argv[1];
+    }
+  }
+  int interactive = command_string == NULL && script_path == NULL && isatty(STDIN_FILENO);
+
   // Check if we are in an interactive terminal. If so, enable custom raw mode.
-  if (isatty(STDIN_FILENO)) {
+  if (interactive) {
       enable_raw_mode();
   }
+  init_job_control(interactive);
   
   // Disable output buffering so prompts appear immediately
   setbuf(stdout, NULL);
@@ -878,105 +5069,40 @@ int main(int argc, char *argv[]) {
   } else {
     parse_path(shell_path); 
   }
+  path_index_init();
+  events_init(interactive); // After path_index_init(): watches its inotify fd
 
-  char command[1024];
+  // Choose how child processes are started (see PROCESS SPAWNING below)
+  select_spawn_backend(getenv("SHELL_SPAWN"));
+  select_token_scanner();
+
+  if (command_string != NULL) {
+    // argv strings are writable, and the NUL after the string gives run_script_text its terminator
+    run_script_text(command_string, strlen(command_string));
+    return last_status;
+  }
+  if (script_path != NULL) {
+    return run_script_file(script_path);
+  }
+  if (!interactive) {
+    // Piped/redirected stdin: same as a script, no prompt or echo. The commands
+    // read the same stdin, so it is never read past the line being run.
+    run_script_fd(STDIN_FILENO);
+    return last_status;
+  }
 
   // MAIN LOOP
+  read_heredoc_line = read_heredoc_interactive;
   while (1) {
     printf("$ ");
     
     // Get input (Raw mode aware)
-    if (read_input_line(command, sizeof(command)) == 0) break;
-    
-    char *argv[MAX_ARGS];
-    int argc = parse_command(command, argv, MAX_ARGS);
-
-    if (argc == 0) continue; // Empty input
-
-    // --- PIPELINE DETECTION ---
-    // Scan for the pipe operator "|"
-    int pipe_idx = -1;
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "|") == 0) {
-            pipe_idx = i;
-            break;
-        }
-    }
-
-    if (pipe_idx != -1) {
-        // === PIPELINE EXECUTION ===
-        // Split the argument list into two parts at the pipe operator
-        
-        free(argv[pipe_idx]); // Free the "|" string
-        argv[pipe_idx] = NULL; // Terminate the first command's argument list
-        
-        // Command 1: argv[0] ... argv[pipe_idx-1]
-        char **argv1 = argv;
-        int argc1 = pipe_idx;
-        
-        // Command 2: argv[pipe_idx+1] ... argv[argc-1]
-        char **argv2 = &argv[pipe_idx + 1];
-        int argc2 = argc - (pipe_idx + 1);
-        
-        if (argc1 > 0 && argc2 > 0) {
-            run_pipeline(argc1, argv1, argc2, argv2);
-        } else {
-            fprintf(stderr, "Invalid pipeline\n");
-        }
-    } else {
-        // === NORMAL EXECUTION ===
-        // Handle single command (Built-in or External) with optional redirection
-        
-        char *redirect_out = NULL;
-        char *redirect_err = NULL;
-        int redirect_out_append = 0;
-        int redirect_err_append = 0;
-        
-        parse_redirections(&argc, argv, &redirect_out, &redirect_err, &redirect_out_append, &redirect_err_append);
-        
-        char *cmd_name = argv[0];
-        int found = 0;
-
-        // 1. Try to execute as Built-in
-        for (int i = 0; i < num_builtins(); i++) {
-          if (strcmp(cmd_name, builtins[i].name) == 0) {
-            int saved_stdout = -1;
-            int saved_stderr = -1;
-            
-            if (redirect_out != NULL) {
-              saved_stdout = save_and_redirect_fd(redirect_out, STDOUT_FILENO, redirect_out_append);
-            }
-            if (redirect_err != NULL) {
-              saved_stderr = save_and_redirect_fd(redirect_err, STDERR_FILENO, redirect_err_append);
-            }
-
-            builtins[i].func(argc, argv);
-
-            restore_fd(saved_stdout, STDOUT_FILENO);
-            restore_fd(saved_stderr, STDERR_FILENO);
-            found = 1;
-            break;
-          }
-        }
+    if (read_input_line(&input_line) == 0) break;
 
-        // 2. Try to execute as External Program
-        if (!found) {
-          char *full_path = ext_check(cmd_name);
-          if (full_path != NULL){
-            execute_external_program(full_path, argc, argv, redirect_out, redirect_err, redirect_out_append, redirect_err_append);
-          } else {
-            printf("%s: command not found\n", cmd_name);
-          }
-        }
-        
-        if (redirect_out) free(redirect_out);
-        if (redirect_err) free(redirect_err);
-    }
+    // Apply PATH changes (programs installed/removed while we waited for input)
+    path_index_drain();
 
-    // Free memory allocated by strdup in parse_command
-    for (int i = 0; i < argc; i++) {
-      free(argv[i]);
-    }
+    execute_line(input_line.data);
   }
-  return 0;
-}
\ No newline at end of file
+  return last_status;
+}